@@ -0,0 +1,34 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#ifndef _MACHINA_CLOCK_H_
+#define _MACHINA_CLOCK_H_
+
+#include <machina/types.h>
+#include <machina/message.h>
+
+/*
+  Clock Alarm message.
+
+  Sent by the clock service to the port passed to `clock_alarm`,
+  once the kernel monotonic clock has reached `alarm_time`. The
+  message carries the requested time, in nanoseconds.
+
+  Virtual time alarms set by `thread_set_vtalarm` use the same
+  format, with `alarm_time` the CPU time of the thread the alarm was
+  due at.
+*/
+#define MCN_CLOCK_ALARM_MSGID		3500
+#define MCN_CLOCK_VTALARM_MSGID		3501
+
+typedef struct
+{
+  mcn_msgheader_t alarm_header;
+  mcn_msgtype_t alarm_type;
+  uint64_t alarm_time;
+} mcn_clock_alarm_msg_t;
+
+#endif
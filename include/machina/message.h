@@ -141,4 +141,20 @@ typedef struct mcn_msgheader
 #define MCN_MSGHEADER_SIZE_64 (4 + 4 + 8 + 8 + 4 + 4)
 #define MCN_MSGHEADER_SIZE_32 (4 + 4 + 4 + 4 + 4 + 4)
 
+/*
+  Short messages.
+
+  Sent with the short send trap, with destination, message id and
+  data words passed in registers. They are received as normal
+  messages, with no reply port and a single inline array of words.
+*/
+#define MCN_MSGSHORT_WORDS 4
+
+typedef struct
+{
+  mcn_msgheader_t msgs_header;
+  mcn_msgtype_t msgs_type;
+  unsigned long msgs_words[MCN_MSGSHORT_WORDS];
+} mcn_msgshort_t;
+
 #endif
@@ -0,0 +1,36 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#ifndef _MACHINA_NOTIFY_H_
+#define _MACHINA_NOTIFY_H_
+
+#include <machina/types.h>
+#include <machina/message.h>
+
+/*
+  Kernel generated notifications.
+
+  Message IDs follow the Mach numbering.
+*/
+#define MCN_NOTIFY_FIRST		0100
+#define MCN_NOTIFY_MSG_ACCEPTED		(MCN_NOTIFY_FIRST + 014)
+
+/*
+  Message Accepted notification.
+
+  Sent to the notify port of a MCN_MSGOPT_SEND_NOTIFY send that has
+  been parked on a full port, once the message has been queued.
+  `not_port` is the name of the destination port in the sender's
+  space at the time of the send.
+*/
+typedef struct
+{
+  mcn_msgheader_t not_header;
+  mcn_msgtype_t not_type;
+  mcn_portid_t not_port;
+} mcn_msg_accepted_notification_t;
+
+#endif
@@ -0,0 +1,33 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#ifndef _MACHINA_PORTSTATUS_H_
+#define _MACHINA_PORTSTATUS_H_
+
+#include <stdint.h>
+#include <nux/defs.h>
+#include <machina/kernparam.h>
+
+/*
+  Port Status Page.
+
+  A read-only page shared between the kernel and a task. Each slot
+  of the page can be bound to a port the task holds the receive
+  right for. The kernel updates it every time a message is queued to
+  or dequeued from the port.
+
+  `ps_gen` is incremented after every update of `ps_pending`, and
+  when the slot is unbound.
+*/
+typedef struct
+{
+  volatile uint32_t ps_pending;
+  volatile uint32_t ps_gen;
+} mcn_portstatus_t;
+
+#define MCN_PORTSTATUS_SLOTS (MSGBUF_SIZE / sizeof (mcn_portstatus_t))
+
+#endif
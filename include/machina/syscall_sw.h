@@ -8,10 +8,17 @@
 #include <machina/types.h>
 
 #define __syscall_msgbuf -1L
+#define __syscall_status_page -2L
+#define __syscall_time_page -3L
 
 #define __syscall_msgsend -20L
 #define __syscall_msgrecv -21L
+#define __syscall_msgsend_short -22L
 #define __syscall_reply_port -26L
 #define __syscall_task_self -27L
+#define __syscall_port_status -28L
+#define __syscall_thread_self -29L
+#define __syscall_host_self -30L
+#define __syscall_thread_switch -31L
 
 
@@ -0,0 +1,103 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#ifndef _MACHINA_TIMEPAGE_H_
+#define _MACHINA_TIMEPAGE_H_
+
+#include <stdint.h>
+
+/*
+  Time Page.
+
+  A read-only page shared by the kernel with every task, publishing
+  the kernel monotonic clock, in nanoseconds.
+
+  The kernel periodically stores the current time `tp_nsecs`, the
+  value of the CPU counter at that time `tp_counter`, and the number
+  of nanoseconds per counter unit `tp_mult`, as 32.32 fixed point.
+  Readers extrapolate the current time from the counter. If the
+  counter can't be read from user mode, `tp_mult` is zero and the
+  time is only as precise as the update period.
+
+  `tp_seq` is odd while the kernel updates the page. Readers retry
+  if it is odd or has changed during the read.
+*/
+typedef struct
+{
+  volatile uint32_t tp_seq;
+  volatile uint32_t tp_pad;
+  volatile uint64_t tp_nsecs;
+  volatile uint64_t tp_counter;
+  volatile uint64_t tp_mult;
+} mcn_timepage_t;
+
+#define MCN_TIMEPAGE_MULT_SHIFT 32
+
+/*
+  Read the CPU counter the time page is based on. Returns zero where
+  there is none readable from user mode.
+
+  The read is ordered after the preceding loads, so that it can't be
+  taken before the page is, and look older than `tp_counter`.
+*/
+static inline uint64_t
+mcn_timepage_counter (void)
+{
+#if __i386__ || __amd64__
+  uint32_t lo, hi;
+
+  __asm__ volatile ("lfence\n\trdtsc":"=a" (lo), "=d" (hi)::"memory");
+  return ((uint64_t) hi << 32) | lo;
+#else
+  return 0;
+#endif
+}
+
+/*
+  Nanoseconds from counter value `then` to `now`. A counter behind
+  `then`, as read on a CPU slightly out of sync with the updater,
+  counts as no time, and the product saturates rather than wrap if
+  the page hasn't been updated for long.
+*/
+static inline uint64_t
+mcn_timepage_delta (uint64_t now, uint64_t then, uint64_t mult)
+{
+  int64_t delta = (int64_t) (now - then);
+  uint64_t prod;
+
+  if (delta <= 0)
+    return 0;
+  if (__builtin_mul_overflow ((uint64_t) delta, mult, &prod))
+    prod = UINT64_MAX;
+  return prod >> MCN_TIMEPAGE_MULT_SHIFT;
+}
+
+/*
+  Current time according to the page.
+*/
+static inline uint64_t
+mcn_timepage_read (const mcn_timepage_t *tp)
+{
+  uint32_t seq;
+  uint64_t nsecs, counter, mult;
+
+  do
+    {
+      while ((seq = __atomic_load_n (&tp->tp_seq, __ATOMIC_ACQUIRE)) & 1)
+	;
+      nsecs = tp->tp_nsecs;
+      counter = tp->tp_counter;
+      mult = tp->tp_mult;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while (__atomic_load_n (&tp->tp_seq, __ATOMIC_RELAXED) != seq);
+
+  if (mult != 0)
+    nsecs += mcn_timepage_delta (mcn_timepage_counter (), counter, mult);
+  return nsecs;
+}
+
+#endif
@@ -47,6 +47,39 @@ typedef unsigned mcn_msgcount_t;
 
 typedef int mcn_return_t;
 
+/*
+  Thread priorities. Zero is the highest.
+
+  The first MCN_PRI_RT_LEVELS levels are the real-time class: threads
+  there are never preempted by lower classes, and must be admitted
+  with a period and a computation time.
+*/
+#define MCN_PRI_LEVELS 32
+#define MCN_PRI_RT_LEVELS 8
+#define MCN_PRI_USER 12
+
+/*
+  thread_switch options.
+*/
+#define MCN_SWITCH_NONE 0
+#define MCN_SWITCH_DEPRESS 1
+
+/*
+  Per-CPU scheduler statistics.
+
+  `ss_latency[i]` counts the threads that waited between 2^i and
+  2^(i+1) nanoseconds in a run queue before running. The last bucket
+  also counts all the longer waits.
+*/
+#define MCN_SCHEDSTATS_BUCKETS 32
+
+typedef struct
+{
+  long ss_switches;
+  long ss_migrations;
+  long ss_latency[MCN_SCHEDSTATS_BUCKETS];
+} mcn_schedstats_t;
+
 typedef unsigned mcn_msgopt_t;
 #define MCN_MSGOPT_NONE			0x000
 #define MCN_MSGOPT_SEND_TIMEOUT		0x010
@@ -55,6 +88,18 @@ typedef unsigned mcn_msgopt_t;
 #define MCN_MSGOPT_RECV_TIMEOUT		0x100
 #define MCN_MSGOPT_RECV_NOTIFY		0x200
 #define MCN_MSGOPT_RECV_LARGE		0x400
+#define MCN_MSGOPT_RECV_SPIN		0x1000
+
+/*
+  Time a MCN_MSGOPT_RECV_SPIN receive polls before sleeping, in
+  microseconds, stored in the high bits of the options. Zero uses
+  the kernel default.
+*/
+#define MCN_MSGOPT_RECV_SPIN_SHIFT	16
+#define MCN_MSGOPT_RECV_SPIN_USECS(_us)					\
+  (MCN_MSGOPT_RECV_SPIN | ((mcn_msgopt_t) (_us) << MCN_MSGOPT_RECV_SPIN_SHIFT))
+#define MCN_MSGOPT_RECV_SPIN_GETUSECS(_opt)	\
+  ((_opt) >> MCN_MSGOPT_RECV_SPIN_SHIFT)
 
 #define MCN_MSGTIMEOUT_NONE 0
 
@@ -0,0 +1,335 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#include <machina/clock.h>
+#include <machina/error.h>
+#include <machina/timepage.h>
+#include <nux/slab.h>
+
+#include "internal.h"
+
+/*
+  Time Page.
+
+  The page is updated every CLOCK_UPDATE_NSECS by a timer of the
+  boot CPU, which is the only writer. The counter rate is measured
+  against the kernel clock since boot, so it gets more precise as
+  time passes.
+*/
+static vaddr_t timepage_kaddr;
+static mcn_timepage_t *timepage;
+static struct timer clock_timer;
+static uint64_t clock_nsecs0;
+static uint64_t clock_counter0;
+
+/*
+  Clock Service.
+
+  The kernel monotonic clock, exported through a kernel port. Alarms
+  are plain kernel timers that queue a message when they expire, so
+  they don't need a thread each. They are given slack proportional to
+  their duration, so that far deadlines coalesce.
+
+  Alarms are charged to the task that requested them, which can have
+  at most CLOCK_ALARMS_MAX pending, and are cancelled when it is
+  freed. The task lock protects its alarm list.
+*/
+static struct clock sysclock;
+static struct slab alarms;
+
+struct alarm
+{
+  struct timer timer;
+  uint64_t time;
+  struct portref port;
+  struct task *task;
+  LIST_ENTRY (alarm) list;
+};
+
+/*
+  Nanoseconds per counter unit, in 32.32 fixed point. The shifted
+  nanoseconds since boot don't fit 64 bits for long, so the
+  fractional bits are computed by long division, and all of them are
+  kept however long the system runs.
+*/
+static uint64_t
+clock_mult (uint64_t nsecs, uint64_t counts)
+{
+  uint64_t q, r;
+  bool carry;
+
+  if (counts == 0)
+    return 0;
+
+  q = nsecs / counts;
+  r = nsecs % counts;
+  if ((q >> (64 - MCN_TIMEPAGE_MULT_SHIFT)) != 0)
+    return UINT64_MAX;
+
+  for (unsigned i = 0; i < MCN_TIMEPAGE_MULT_SHIFT; i++)
+    {
+      /* r < counts, but 2 * r might not fit. */
+      carry = (r >> 63) != 0;
+      r <<= 1;
+      q <<= 1;
+      if (carry || (r >= counts))
+	{
+	  r -= counts;
+	  q |= 1;
+	}
+    }
+  return q;
+}
+
+static void
+clock_update (void)
+{
+  mcn_timepage_t *tp = timepage;
+  uint64_t now = timer_gettime ();
+  uint64_t counter = mcn_timepage_counter ();
+  uint64_t mult, prev;
+
+  mult = clock_mult (now - clock_nsecs0, counter - clock_counter0);
+
+  /* Don't go back from what readers could have seen. */
+  if (tp->tp_mult != 0)
+    {
+      prev = tp->tp_nsecs + mcn_timepage_delta (counter, tp->tp_counter,
+						tp->tp_mult);
+      if (prev > now)
+	now = prev;
+    }
+
+  __atomic_store_n (&tp->tp_seq, tp->tp_seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  tp->tp_nsecs = now;
+  tp->tp_counter = counter;
+  tp->tp_mult = mult;
+  __atomic_store_n (&tp->tp_seq, tp->tp_seq + 1, __ATOMIC_RELEASE);
+
+  nuxperf_inc (&pmachina_clock_updates);
+}
+
+static void
+clock_expired (void *opq)
+{
+  clock_update ();
+  clock_timer.valid = 1;
+  clock_timer.slack = timer_slack (CLOCK_UPDATE_NSECS);
+  timer_register (&clock_timer, CLOCK_UPDATE_NSECS);
+}
+
+vaddr_t
+clock_timepage (void)
+{
+  return timepage_kaddr;
+}
+
+struct clock *
+clock_system (void)
+{
+  return &sysclock;
+}
+
+struct portref
+clock_getport (struct clock *clock)
+{
+  return portref_dup (&clock->self);
+}
+
+/*
+  Current time of the clock. The time page can run slightly ahead of
+  the kernel timer, as it never goes back: report the time users see
+  in the page, so that alarms and clock_get_time agree with it.
+*/
+uint64_t
+clock_now (void)
+{
+  uint64_t now = timer_gettime ();
+  uint64_t tp = mcn_timepage_read (timepage);
+
+  return tp > now ? tp : now;
+}
+
+/*
+  Send an alarm message to `port`, consuming the reference.
+*/
+void
+clock_sendalarm (struct portref *port, mcn_msgid_t msgid, uint64_t time)
+{
+  mcn_return_t rc;
+  mcn_clock_alarm_msg_t *m;
+  const mcn_msgsize_t size = sizeof (mcn_clock_alarm_msg_t);
+
+  m = (mcn_clock_alarm_msg_t *) kmem_alloc (0, size);
+  m->alarm_header.msgh_bits = MCN_MSGBITS (0, MCN_MSGTYPE_PORTSEND);
+  m->alarm_header.msgh_size = size;
+  m->alarm_header.msgh_remote = MCN_PORTID_NULL;
+  m->alarm_header.msgh_local = portref_to_ipcport (port);
+  m->alarm_header.msgh_seqno = 0;
+  m->alarm_header.msgh_msgid = msgid;
+  m->alarm_type = (mcn_msgtype_t) {
+    .msgt_name = MCN_MSGTYPE_INT64,
+    .msgt_size = 64,
+    .msgt_number = 1,
+    .msgt_inline = 1,
+  };
+  m->alarm_time = time;
+
+  rc = port_enqueue (&m->alarm_header, 0, true, NULL, 0);
+  if (rc)
+    {
+      nuxperf_inc (&pmachina_clock_alarms_failed);
+      ipc_intmsg_consume (&m->alarm_header);
+      kmem_free (0, (vaddr_t) m, size);
+      return;
+    }
+  nuxperf_inc (&pmachina_clock_alarms_sent);
+}
+
+/*
+  Arm the timer of an alarm for its time. Called with the task
+  locked.
+*/
+static void
+alarm_arm (struct alarm *a)
+{
+  uint64_t now = clock_now ();
+  uint64_t nsecs = a->time > now ? a->time - now : 0;
+
+  a->timer.valid = 1;
+  a->timer.slack = timer_slack (nsecs);
+  timer_register (&a->timer, nsecs);
+}
+
+static void
+alarm_expired (void *opq)
+{
+  struct alarm *a = (struct alarm *) opq;
+  struct task *task = a->task;
+  struct portref port;
+  uint64_t time = a->time;
+
+  task_lock (task);
+  /* Cancelled, and freed by clock_cancelalarms. */
+  if (!timer_claim (&a->timer))
+    {
+      task_unlock (task);
+      return;
+    }
+  /* The timer ran ahead of the page's time: wait for the rest. */
+  if (clock_now () < time)
+    {
+      alarm_arm (a);
+      task_unlock (task);
+      return;
+    }
+  LIST_REMOVE (a, list);
+  task->nr_alarms--;
+  task_unlock (task);
+
+  portref_move (&port, &a->port);
+  slab_free (a);
+  clock_sendalarm (&port, MCN_CLOCK_ALARM_MSGID, time);
+}
+
+/*
+  Send a message to `port` when the clock reaches `time`, on behalf
+  of `task`. Consumes the port reference.
+*/
+mcn_return_t
+clock_setalarm (struct clock *clock, struct task *task, uint64_t time,
+		struct portref *port)
+{
+  struct alarm *a;
+
+  a = slab_alloc (&alarms);
+  if (a == NULL)
+    {
+      portref_consume (port);
+      return KERN_RESOURCE_SHORTAGE;
+    }
+
+  a->time = time;
+  a->task = task;
+  portref_move (&a->port, port);
+  timer_init (&a->timer);
+  a->timer.opq = (void *) a;
+  a->timer.handler = alarm_expired;
+
+  task_lock (task);
+  if (task->nr_alarms >= CLOCK_ALARMS_MAX)
+    {
+      task_unlock (task);
+      nuxperf_inc (&pmachina_clock_alarms_failed);
+      portref_consume (&a->port);
+      slab_free (a);
+      return KERN_RESOURCE_SHORTAGE;
+    }
+  LIST_INSERT_HEAD (&task->alarms, a, list);
+  task->nr_alarms++;
+  alarm_arm (a);
+  task_unlock (task);
+
+  nuxperf_inc (&pmachina_clock_alarms);
+  return KERN_SUCCESS;
+}
+
+/*
+  Cancel the pending alarms of a task being freed.
+*/
+void
+clock_cancelalarms (struct task *task)
+{
+  LIST_HEAD (, alarm) cancelled = LIST_HEAD_INITIALIZER (cancelled);
+  struct alarm *a;
+
+  task_lock (task);
+  while ((a = LIST_FIRST (&task->alarms)) != NULL)
+    {
+      LIST_REMOVE (a, list);
+      timer_remove (&a->timer);
+      LIST_INSERT_HEAD (&cancelled, a, list);
+    }
+  task->nr_alarms = 0;
+  task_unlock (task);
+
+  /* A handler might still be looking at them, and at the task. */
+  while ((a = LIST_FIRST (&cancelled)) != NULL)
+    {
+      LIST_REMOVE (a, list);
+      timer_remove_sync (&a->timer);
+      portref_consume (&a->port);
+      slab_free (a);
+    }
+}
+
+/*
+  Called on the boot CPU, once its timers are set up.
+*/
+void
+clock_init (void)
+{
+  timepage_kaddr = kva_alloc (MSGBUF_SIZE);
+  if (timepage_kaddr == VADDR_INVALID)
+    fatal ("Can't allocate time page.");
+  if (kmap_ensure_range (timepage_kaddr, MSGBUF_SIZE, HAL_PTE_W | HAL_PTE_P))
+    fatal ("Can't map time page.");
+  memset ((void *) timepage_kaddr, 0, MSGBUF_SIZE);
+  timepage = (mcn_timepage_t *) timepage_kaddr;
+
+  clock_nsecs0 = timer_gettime ();
+  clock_counter0 = mcn_timepage_counter ();
+  clock_update ();
+
+  timer_init (&clock_timer);
+  clock_timer.opq = NULL;
+  clock_timer.handler = clock_expired;
+  clock_expired (NULL);
+
+  slab_register (&alarms, "ALARMS", sizeof (struct alarm), NULL, 0);
+  port_alloc_kernel ((void *) &sysclock, KOT_CLOCK, &sysclock.self);
+}
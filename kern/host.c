@@ -15,6 +15,12 @@ host_init (void)
   port_alloc_kernel (&host, KOT_HOST_CTRL, &host.ctrl);
 }
 
+struct host *
+host_system (void)
+{
+  return &host;
+}
+
 struct portref
 host_getctrlport (struct host *host)
 {
@@ -26,3 +32,25 @@ host_getnameport (struct host *host)
 {
   return portref_dup (&host->name);
 }
+
+mcn_portid_t
+host_self (void)
+{
+  mcn_portid_t ret;
+  struct ipcspace *ps;
+  struct portright pr;
+  struct task *t = cur_task ();
+
+  pr.type = RIGHT_SEND;
+  pr.portref = host_getnameport (&host);
+
+  ps = task_getipcspace (t);
+  if (ipcspace_insertright (ps, &pr, &ret))
+    {
+      portright_consume (&pr);
+      ret = MCN_PORTID_NULL;
+    }
+  task_putipcspace (t, ps);
+
+  return ret;
+}
@@ -17,8 +17,29 @@
 #include <nux/nuxperf.h>
 #include <machina/kernparam.h>
 #include <machina/message.h>
+#include <machina/portstatus.h>
 #include "ref.h"
 
+/*
+  Cache line size. Structures written by several CPUs keep the
+  fields written remotely in separate cache lines.
+*/
+#define CACHELINE_SIZE 64
+#define __cacheline_aligned __attribute__ ((aligned (CACHELINE_SIZE)))
+
+/*
+  Hint to the CPU that we are in a polling loop.
+*/
+static inline void
+cpu_relax (void)
+{
+#if __i386__ || __amd64__
+  __asm__ volatile ("pause":::"memory");
+#else
+  __asm__ volatile ("":::"memory");
+#endif
+}
+
 /*
   Measure port spinlock.
 */
@@ -37,13 +58,99 @@
 /*
   Measure sched spinlock.
 */
-#define SCHED_LOCK_SPINLOCK 0
+#define SCHED_LOCK_MEASURE 0
 
 /*
   Measure waitq spinlock.
 */
 #define WAITQ_LOCK_MEASURE 0
 
+/*
+  Scheduling quantum of a thread at priority `_pri`, in
+  nanoseconds. Higher priority threads get shorter quanta.
+*/
+#define SCHED_QUANTUM_NSECS(_pri) ((5 + (_pri) / 2) * 1000 * 1000UL)
+
+/*
+  Time a runnable thread can wait behind higher priority threads
+  before being picked anyway, in nanoseconds.
+*/
+#define SCHED_AGING_NSECS (100 * 1000 * 1000)
+
+/*
+  Maximum number of processor sets, including the default one.
+*/
+#define PROCSET_MAX 8
+
+/*
+  Maximum utilization of a CPU by real-time threads, in thousandths.
+*/
+#define SCHED_RT_UTIL_MAX 800
+
+/*
+  A real-time thread that uses more than SCHED_RT_WATCHDOG times its
+  computation time in a period is demoted to MCN_PRI_USER.
+*/
+#define SCHED_RT_WATCHDOG 4
+
+/*
+  Maximum time an idle CPU polls its run queue before halting, in
+  nanoseconds. The actual window adapts to the CPU's recent idle
+  periods.
+*/
+#define SCHED_IDLE_SPIN_NSECS 50000
+
+/*
+  Time a MCN_MSGOPT_RECV_SPIN receive polls an empty port before
+  going to sleep, in nanoseconds, if the receive doesn't ask for a
+  specific time. Longer requests are capped to IPC_RECV_SPIN_MAX_NSECS,
+  as the CPU can't schedule while polling.
+*/
+#define IPC_RECV_SPIN_NSECS 20000
+#define IPC_RECV_SPIN_MAX_NSECS (1000 * 1000UL)
+
+/*
+  Number of threads dequeued from a wait queue per lock hold when
+  waking them all.
+*/
+#define WAITQ_BATCH 16
+
+/*
+  Time a CPU can spend tearing down dead threads before returning to
+  a thread, in nanoseconds. Dead tasks are only torn down when the
+  CPU is idle, or one at a time if they have been waiting for more
+  than REAPER_STARVE_NSECS on a CPU that is never idle.
+*/
+#define REAPER_BUDGET_NSECS 50000
+#define REAPER_STARVE_NSECS (10 * 1000 * 1000UL)
+
+/*
+  Timer wheel tick, as a power of two of nanoseconds, and number of
+  levels. Each level has 64 slots and covers 64 times the range of
+  the one below: with 16us ticks, five levels cover about 4.9 hours.
+  Later timers are kept in the last level until they get closer.
+*/
+#define TIMER_TICK_SHIFT 14
+#define TIMER_WHEEL_LEVELS 5
+
+/*
+  Slack of IPC timeouts: they can fire up to 1/2^TIMER_SLACK_SHIFT
+  of their duration late, and at most TIMER_SLACK_MAX_NSECS, so that
+  timeouts close to each other are handled by a single alarm.
+*/
+#define TIMER_SLACK_SHIFT 4
+#define TIMER_SLACK_MAX_NSECS (1000 * 1000UL)
+
+/*
+  Period of the time page updates, in nanoseconds.
+*/
+#define CLOCK_UPDATE_NSECS (10 * 1000 * 1000UL)
+
+/*
+  Maximum number of clock alarms a task can have pending.
+*/
+#define CLOCK_ALARMS_MAX 64
+
 
 /*
   RAM reserved for kernel allocation, when memory is low.
@@ -80,7 +187,8 @@ void unshare_kva (struct umap *umap, uaddr_t uaddr, size_t size);
   Message Buffers.
 
   Each thread has a message buffer, a shared area between user and
-  kernel used for IPC messages.
+  kernel used for IPC messages. Tasks might have a read-only one for
+  the port status page.
 */
 struct msgbuf
 {
@@ -91,9 +199,12 @@ struct msgbuf
 struct msgbuf_zone;
 void msgbuf_init (void);
 bool msgbuf_alloc (struct umap *umap, struct msgbuf_zone *z,
+		   struct msgbuf *mb, bool uwr);
+bool msgbuf_share (struct umap *umap, struct msgbuf_zone *z, vaddr_t kaddr,
 		   struct msgbuf *mb);
 void msgbuf_free (struct umap *umap, struct msgbuf_zone *z,
 		  struct msgbuf *mb);
+void msgbuf_kfree (struct msgbuf *mb);
 
 
 /*
@@ -101,13 +212,57 @@ void msgbuf_free (struct umap *umap, struct msgbuf_zone *z,
 */
 /**INDENT-OFF**/
 struct thread;
+struct timerwheel;
 struct timer
 {
   int valid;
   uint64_t time;
+  uint64_t slack;
   void *opq;
   void (*handler) (void *opq);
   LIST_ENTRY (timer) list;
+  struct timerwheel *wheel;
+  /* Wheel whose CPU last ran the handler. */
+  struct timerwheel *ran;
+  uint8_t level;
+  uint8_t slot;
+};
+
+/*
+  Timer Wheels.
+
+  Every CPU keeps the timers registered on it in a hierarchical
+  wheel. Slot `i` of level `l` holds the timers expiring in tick
+  `i` modulo 64 of that level, and each time the level below wraps
+  around, a slot is cascaded down. Timers are inserted and removed in
+  constant time, and the hardware alarm is set to the earliest
+  deadline only.
+
+  A timer with a `slack` can fire anywhere between `time` and `time
+  + slack`. Timers are kept in the wheel by their latest time, and
+  the alarm is set to the earliest of those. When the alarm fires,
+  all timers whose window has started are run with it.
+
+  Handlers run on the CPU the timer was registered on, without the
+  wheel lock held. A timer removed while its handler is about to run
+  might still fire: handlers of timers removed or registered again
+  from other paths take the lock those paths hold and check with
+  timer_claim that the expiry is still current. A timer whose
+  handler might be running is freed after timer_remove_sync.
+*/
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timerwheel
+{
+  lock_t lock;
+  uint64_t clk;
+  uint64_t alarm;
+  uint64_t bitmap[TIMER_WHEEL_LEVELS];
+  LIST_HEAD (, timer) slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  LIST_HEAD (, timer) expired;
+  /* Timer whose handler is running. */
+  struct timer *running;
 };
 /**INDENT-ON**/
 
@@ -115,10 +270,24 @@ static inline void
 timer_init (struct timer *t)
 {
   t->valid = 0;
+  t->slack = 0;
+  t->wheel = NULL;
+  t->ran = NULL;
 }
 
+static inline uint64_t
+timer_slack (uint64_t nsecs)
+{
+  uint64_t slack = nsecs >> TIMER_SLACK_SHIFT;
+
+  return slack < TIMER_SLACK_MAX_NSECS ? slack : TIMER_SLACK_MAX_NSECS;
+}
+
+void timer_cpu_init (struct timerwheel *w);
 void timer_register (struct timer *t, uint64_t nsecs);
 void timer_remove (struct timer *timer);
+bool timer_claim (struct timer *t);
+void timer_remove_sync (struct timer *t);
 void timer_run (void);
 
 
@@ -130,8 +299,8 @@ void timer_run (void);
 
 extern cpumask_t idlemap;
 
-void cpu_kick (void);
 void ipc_kern_exec (void);
+void kern_enter (uctxt_t *uctxt);
 uctxt_t *kern_return (void);
 
 /**INDENT-OFF**/
@@ -197,8 +366,38 @@ void _sched_add (struct thread *th);
 void _sched_suspend (struct thread *th);
 void _sched_abort (struct thread *th);
 void _sched_resume (struct thread *th);
+void _sched_wakeup (struct thread *th, cpumask_t *kick);
+void sched_kick (cpumask_t kick);
 void _sched_destroy (struct thread *th);
+void _sched_setpri (struct thread *th, unsigned pri);
+mcn_return_t _sched_setrt (struct thread *th, unsigned pri, uint64_t period,
+			   uint64_t computation);
+struct procset;
+void _sched_setpset (struct thread *th, struct procset *ps);
+struct threadref;
+void sched_handoff_to (struct threadref *ref);
+void sched_depress (struct thread *th, uint64_t nsecs);
+void sched_undepress (struct thread *th, bool intimer);
 uctxt_t *sched_next (void);
+bool sched_pending (void);
+void sched_acct_enter (void);
+void sched_acct_exit (void);
+mcn_return_t sched_stats (unsigned cpu, mcn_schedstats_t *stats);
+
+/**INDENT-OFF**/
+struct runq
+{
+  lock_t lock;
+  unsigned nr;
+  uint32_t bitmap;
+  TAILQ_HEAD (, thread) queue[MCN_PRI_LEVELS];
+};
+/**INDENT-ON**/
+
+struct mcncpu;
+void sched_cpu_init (struct mcncpu *cpu);
+struct mcncpu *sched_cpu (unsigned cpu);
+bool sched_cpu_setpset (struct mcncpu *cpu, struct procset *ps);
 
 /*
   Port Space: a collection of port rights.
@@ -233,6 +432,16 @@ mcn_return_t ipcspace_resolve_receive (struct ipcspace *ps, mcn_portid_t id,
 void ipcspace_print (struct ipcspace *ps);
 
 
+/*
+  IPC_PORT_T type.
+  
+  'ipc_port_t' is a type equivalent to a port reference, but typedef'd
+  to mcn_portid_t, so that port references can be used in internalised
+  version of messages.
+*/
+
+typedef mcn_portid_t ipc_port_t;
+
 /*
   Ports.
 
@@ -250,6 +459,13 @@ struct msgq_entry
 {
   TAILQ_ENTRY (msgq_entry) queue;
   mcn_msgheader_t *msgh;
+
+  /*
+    Parked messages only: the msg-accepted notify port and the
+    sender's name for the destination.
+  */
+  ipc_port_t notify;
+  mcn_portid_t notify_name;
 };
 
 /**INDENT-OFF**/
@@ -260,6 +476,14 @@ void msgq_init (msgqueue_t * msgq);
 mcn_return_t msgq_enq (msgqueue_t * msgq, mcn_msgheader_t * msgh);
 bool msgq_deq (msgqueue_t * msgq, mcn_msgheader_t ** msghp);
 
+/*
+  A port message queue.
+
+  When the queue is full, senders either block in `send_waitq` or, if
+  they asked for MCN_MSGOPT_SEND_NOTIFY, have their message parked in
+  `parkq`. Parked messages take the first free slots of `msgq`, and
+  their sender gets a msg-accepted notification then.
+*/
 struct port_queue
 {
   struct waitq recv_waitq;
@@ -267,6 +491,16 @@ struct port_queue
   unsigned capacity;
   unsigned entries;
   msgqueue_t msgq;
+  unsigned parked;
+  msgqueue_t parkq;
+
+  /*
+    Slot of the receiver's port status page, if bound. `status_map`
+    is the receiver task's slot allocation bitmap.
+  */
+  mcn_portstatus_t *status;
+  unsigned long *status_map;
+  unsigned status_slot;
 };
 
 void portqueue_init (struct port_queue *pq, unsigned limit);
@@ -279,13 +513,15 @@ enum kern_objtype
   KOT_VMOBJ_NAME,
   KOT_HOST_CTRL,
   KOT_HOST_NAME,
+  KOT_PROCSET,
+  KOT_CLOCK,
 };
 
 struct port
 {
-  unsigned long _ref_count;
+  unsigned long _ref_count __cacheline_aligned;
 
-  lock_t lock;
+  lock_t lock __cacheline_aligned;
   enum port_type type;
   union
   {
@@ -316,24 +552,21 @@ struct vmobjref port_get_vmobjref (struct port *port);
 struct vmobjref port_get_vmobjref_from_name (struct port *port);
 struct host *port_get_host_from_name (struct port *port);
 struct host *port_get_host_from_ctrl (struct port *port);
+struct procset *port_get_procset (struct port *port);
+struct clock *port_get_clock (struct port *port);
 mcn_return_t port_alloc_queue (struct portref *portref);
 mcn_return_t port_enqueue (mcn_msgheader_t * msgh, unsigned long timeout,
-			   bool force);
+			   bool force, struct portref *notify,
+			   mcn_portid_t notify_name);
 mcn_return_t port_dequeue (struct port *port, unsigned long timeout,
 			   mcn_msgheader_t ** msghp);
+bool port_spin (struct port *port, uint64_t nsecs);
+mcn_return_t port_bind_status (struct port *port, mcn_portstatus_t *status,
+			       unsigned long *map, unsigned slot);
+void port_unbind_status (struct port *port);
 
 #include "portref.h"
 
-/*
-  IPC_PORT_T type.
-  
-  'ipc_port_t' is a type equivalent to a port reference, but typedef'd
-  to mcn_portid_t, so that port references can be used in internalised
-  version of messages.
-*/
-
-typedef mcn_portid_t ipc_port_t;
-
 static inline ipc_port_t
 portref_to_ipcport (struct portref *portref)
 {
@@ -451,23 +684,53 @@ portright_unsafe_put (struct port **port)
 /**INDENT-OFF**/
 struct thread
 {
-  unsigned long _ref_count;
-  
-  lock_t lock;
-  uctxt_t *uctxt;
-  LIST_ENTRY (thread) list_entry;
+  /*
+    References are taken and released by any CPU.
+  */
+  unsigned long _ref_count __cacheline_aligned;
+
+  /*
+    Read-mostly, or only written by the CPU running the thread. Fields
+    written by other CPUs belong to the thread lock's cache line
+    below.
+  */
+  uctxt_t *uctxt __cacheline_aligned;
+  /*
+    While the thread is in the kernel, its user context is in the
+    entry frame `uframe`, and `uctxt` is stale. It is only saved to
+    `uctxt` when the thread is switched out. Protected by the thread
+    lock once set.
+  */
+  uctxt_t *uframe;
   struct task *task;
   struct msgbuf msgbuf;
   struct portref self;
+  uaddr_t tls;
 
-  int64_t vtt_almdiff;
+  /*
+    Virtual time: the CPU time of the thread. `vtt_offset` is the CPU
+    time at the last switch out, `vtt_rttbase` the time of the last
+    switch in.
+  */
   uint64_t vtt_offset;
   uint64_t vtt_rttbase;
-  struct timer vtt_alarm;
-  unsigned cpu;
 
-  uaddr_t tls;
+  /*
+    CPU time spent in user and kernel mode, in nanoseconds. Only
+    updated by the CPU running the thread.
+  */
+  uint64_t utime;
+  uint64_t stime;
+
+  /* Protected by the task lock. */
+  LIST_ENTRY (thread) list_entry;
 
+  /*
+    Scheduler state, written by wakers and by callers on any CPU
+    under the thread lock. `cpu` is the CPU the thread last ran on,
+    or was queued to by its waker.
+  */
+  lock_t lock __cacheline_aligned;
   enum sched status;
   unsigned long suspend;
   struct
@@ -476,9 +739,61 @@ struct thread
     uint8_t op_suspend:1;
     uint8_t op_destroy:1;
   } sched_op;
+  unsigned pri;
+  unsigned cpu;
+  struct procset *pset;
   struct waitq *waitq;
   struct timer timeout;
 
+  /*
+    Real-time class parameters, `rt_period` is zero for threads not
+    in the class. `rt_release` and `rt_cputime` are the time and the
+    thread CPU time at the start of the current period.
+  */
+  uint64_t rt_period;
+  uint64_t rt_computation;
+  unsigned rt_util;
+  unsigned rt_cpu;
+  uint64_t rt_release;
+  uint64_t rt_cputime;
+  unsigned long rt_misses;
+  unsigned long rt_demotions;
+
+  /*
+    Virtual time alarm, sent to `vtt_almport` when the thread's CPU
+    time reaches `vtt_almtime`, and then every `vtt_almperiod` if not
+    zero. `vtt_almtime` is zero if no alarm is set. The timer is only
+    armed while the thread runs. Protected by the thread lock.
+  */
+  uint64_t vtt_almtime;
+  uint64_t vtt_almperiod;
+  struct portref vtt_almport;
+  struct timer vtt_alarm;
+
+  /*
+    Priority to restore when a depression ends, MCN_PRI_LEVELS if
+    not depressed.
+  */
+  unsigned depress_pri;
+  struct timer depress;
+
+  /*
+    Wait queue linkage. `waitq` is protected by the thread lock,
+    `waitq_queued` and `waitq_list` by the lock of the wait queue.
+    A waker dequeues a thread before locking it, so a thread can
+    have `waitq` set while not being queued anymore.
+  */
+  TAILQ_ENTRY (thread) waitq_list;
+  bool waitq_queued;
+
+  /*
+    Thread that last woke us up from a wait queue. Only compared,
+    never dereferenced.
+  */
+  struct thread *waker;
+
+  uint64_t runq_stamp;
+  struct runq *runq;
   TAILQ_ENTRY (thread) sched_list;
 };
 /**INDENT-ON**/
@@ -504,20 +819,37 @@ struct portref thread_getport (struct thread *th);
 void thread_resume (struct thread *th);
 void thread_suspend (struct thread *th);
 void thread_destroy (struct thread *th);
+void thread_setpriority (struct thread *th, unsigned pri);
+mcn_return_t thread_setrealtime (struct thread *th, unsigned pri,
+				 uint64_t period, uint64_t computation);
+void thread_times (struct thread *th, uint64_t *utime, uint64_t *stime);
+mcn_portid_t thread_self (void);
+mcn_return_t thread_switch (mcn_portid_t name, unsigned option,
+			    unsigned long timeout);
 void thread_wait (struct waitq *wq, unsigned long timeout);
+void thread_unwait (struct thread *th, bool intimer);
+void thread_setvtalrm (struct thread *th, uint64_t nsecs, uint64_t period,
+		       struct portref *port);
+void _thread_vtalrm_arm (struct thread *th);
 bool thread_wakeone (struct waitq *wq);
+unsigned thread_wakeall (struct waitq *wq);
+unsigned thread_waitq_move (struct waitq *from, struct waitq *to);
 void thread_init (void);
 
+/*
+  Get the current user context of a thread. Called with the thread
+  locked, or by the CPU running it.
+*/
 static inline uctxt_t *
 thread_uctxt (struct thread *th)
 {
-  return th->uctxt;
+  return th->uframe != NULL ? th->uframe : th->uctxt;
 }
 
 static inline bool
 thread_isidle (struct thread *th)
 {
-  return thread_uctxt (th) == UCTXT_IDLE;
+  return th->uctxt == UCTXT_IDLE;
 }
 
 #include "threadref.h"
@@ -535,18 +867,60 @@ enum task_status
 /**INDENT-OFF**/
 struct task
 {
-  unsigned long _ref_count;
+  unsigned long _ref_count __cacheline_aligned;
 
-  lock_t lock;
+  /*
+    The task lock also protects the IPC space.
+  */
+  lock_t lock __cacheline_aligned;
   enum task_status status;
-  struct vmmap vmmap;
   LIST_HEAD (, thread) threads;
+  struct procset *pset;
   struct ipcspace ipcspace;
   struct portref self;
   TAILQ_ENTRY (task) task_list;
+
+  /*
+    Port status page. Allocated on first use, `kaddr` is zero
+    otherwise.
+  */
+  struct msgbuf status_page;
+  struct msgbuf time_page;
+  unsigned long status_map[MCN_PORTSTATUS_SLOTS / LONG_BIT];
+
+  /*
+    CPU time of the threads already destroyed.
+  */
+  uint64_t dead_utime;
+  uint64_t dead_stime;
+
+  /*
+    Clock alarms requested by the task and not sent yet.
+  */
+  LIST_HEAD (, alarm) alarms;
+  unsigned nr_alarms;
+
+  /*
+    Has its own lock, taken by page faults.
+  */
+  struct vmmap vmmap __cacheline_aligned;
 };
 /**INDENT-ON**/
 
+#if TASK_LOCK_MEASURE
+
+DECLARE_LOCK_MEASURE(task_lock_msr);
+
+#define task_lock(_t) spinlock_measured (&(_t)->lock, &task_lock_msr)
+#define task_unlock(_t) spinunlock_measured (&(_t)->lock, &task_lock_msr)
+
+#else
+
+#define task_lock(_t) spinlock (&(_t)->lock)
+#define task_unlock(_t) spinunlock (&(_t)->lock)
+
+#endif
+
 void task_init (void);
 void task_bootstrap (struct taskref *taskref);
 void task_destroy (struct task *task);
@@ -567,8 +941,14 @@ mcn_return_t task_vm_region (struct task *t, vaddr_t * addr, size_t *size,
 			     mcn_vminherit_t * inherit, bool *shared,
 			     struct portref *portref, mcn_vmoff_t * off);
 mcn_return_t task_create_thread(struct task *t, struct threadref *ref);
+void task_times (struct task *t, uint64_t *utime, uint64_t *stime);
+void task_setpset (struct task *t, struct procset *ps);
 struct portref task_getport (struct task *task);
 mcn_portid_t task_self (void);
+mcn_return_t task_status_page (struct task *t, uaddr_t *uaddr);
+mcn_return_t task_time_page (struct task *t, uaddr_t *uaddr);
+mcn_return_t task_bind_port_status (struct task *t, mcn_portid_t name,
+				    unsigned *slot);
 
 void _task_cleanup(struct task *t);
 void _task_destroy_thread(struct thread *th);
@@ -580,11 +960,14 @@ void _task_destroy_thread(struct thread *th);
   Machina IPC.
 */
 void ipc_intmsg_consume (mcn_msgheader_t * intmsg);
+void ipc_notify_msgaccepted (struct portref *notify, mcn_portid_t name);
 
 mcn_msgioret_t ipc_msgsend (mcn_msgopt_t opt, unsigned long timeout,
 			    mcn_portid_t notify);
 mcn_msgioret_t ipc_msgrecv (mcn_portid_t recv_port, mcn_msgopt_t opt,
 			    unsigned long timeout, mcn_portid_t notify);
+mcn_msgioret_t ipc_msgsend_short (mcn_portid_t dest, mcn_msgid_t msgid,
+				  const unsigned long *words);
 
 /*
   Per-CPU Data.
@@ -592,15 +975,77 @@ mcn_msgioret_t ipc_msgrecv (mcn_portid_t recv_port, mcn_msgopt_t opt,
 /**INDENT-OFF**/
 struct mcncpu
 {
+  /*
+    Only accessed by this CPU, or read-mostly.
+  */
   struct thread *idle;
   struct thread *thread;
   struct task *task;
   struct msgqueue kernel_msgq;
   TAILQ_HEAD (, thread) dead_threads;
   TAILQ_HEAD(, task) dead_tasks;
+  /*
+    Time dead tasks started waiting for an idle CPU, or zero, and the
+    timer that makes a busy CPU reap one when they have waited too
+    long.
+  */
+  uint64_t reap_stamp;
+  struct timer reap_timer;
+  unsigned id;
+  struct procset *pset;
+  struct timer quantum;
+  uint64_t idle_start;
+  uint64_t idle_avg;
+  uint64_t acct_stamp;
+  struct threadref handoff;
+
+  /*
+    Scheduler statistics. Only updated by this CPU.
+  */
+  unsigned long nr_switches;
+  unsigned long nr_migrations;
+  unsigned long latency[MCN_SCHEDSTATS_BUCKETS];
+
+  /*
+    Written by other CPUs: run queue, protecting also `rt_util`, and
+    the flags set to make this CPU reschedule.
+  */
+  struct runq runq __cacheline_aligned;
+  unsigned rt_util;
+
+  /*
+    Timers registered on this CPU. Removed by any CPU.
+  */
+  struct timerwheel timers __cacheline_aligned;
+
+  bool resched __cacheline_aligned;
+  bool idle_spinning;
+  unsigned long pending;
+  /*
+    Priority of the thread running on this CPU, MCN_PRI_LEVELS if
+    idle. Only written by this CPU, read by CPUs placing real-time
+    threads, which can't safely look at `thread`.
+  */
+  unsigned cur_pri;
 };
 /**INDENT-ON**/
 
+/*
+  Work pending on a CPU, to be done before returning to user. When
+  none is pending, the CPU returns to the current thread without
+  going through the scheduler.
+*/
+#define CPU_PENDING_KMSG	(1UL << 0)	/* Kernel messages queued. */
+#define CPU_PENDING_CLOCK	(1UL << 1)	/* Memory clock ticks. */
+#define CPU_PENDING_REAP	(1UL << 2)	/* Dead threads or tasks. */
+#define CPU_PENDING_SCHED	(1UL << 3)	/* Scheduling ops or handoff. */
+
+static inline void
+cpu_pending_set (struct mcncpu *cpu, unsigned long flags)
+{
+  __atomic_fetch_or (&cpu->pending, flags, __ATOMIC_RELEASE);
+}
+
 static inline struct mcncpu *
 cur_cpu (void)
 {
@@ -772,8 +1217,53 @@ struct host
 };
 
 void host_init (void);
+struct host *host_system (void);
 struct portref host_getctrlport (struct host *host);
 struct portref host_getnameport (struct host *host);
+mcn_portid_t host_self (void);
+
+/*
+  Clock.
+*/
+struct clock
+{
+  struct portref self;
+};
+
+void clock_init (void);
+vaddr_t clock_timepage (void);
+struct clock *clock_system (void);
+struct portref clock_getport (struct clock *clock);
+uint64_t clock_now (void);
+mcn_return_t clock_setalarm (struct clock *clock, struct task *task,
+			     uint64_t time, struct portref *port);
+void clock_cancelalarms (struct task *task);
+void clock_sendalarm (struct portref *port, mcn_msgid_t msgid, uint64_t time);
+
+/*
+  Processor Sets.
+*/
+struct procset
+{
+  cpumask_t cpus;
+  bool active;
+  struct portref self;
+};
+
+void procset_init (void);
+struct procset *procset_default (void);
+struct portref procset_getport (struct procset *ps);
+void procset_addcpu (struct mcncpu *cpu);
+mcn_return_t procset_alloc (struct procset **psp);
+mcn_return_t procset_setcpu (struct procset *ps, unsigned cpu);
+mcn_return_t procset_setthread (struct procset *ps, struct thread *th);
+mcn_return_t procset_settask (struct procset *ps, struct task *t);
+
+static inline bool
+procset_hascpu (struct procset *ps, unsigned cpu)
+{
+  return (__atomic_load_n (&ps->cpus, __ATOMIC_RELAXED) & (1UL << cpu)) != 0;
+}
 
 #include "kmig.h"
 
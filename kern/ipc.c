@@ -13,6 +13,7 @@
 #include "internal.h"
 #include <machina/error.h>
 #include <machina/message.h>
+#include <machina/notify.h>
 
 static inline mcn_msgtype_name_t
 msgbits_sendrecv_intern (mcn_msgtype_name_t type)
@@ -418,6 +419,42 @@ reexternalize (struct ipcspace *ps, mcn_msgheader_t * intmsg,
   return MSGIO_SUCCESS;
 }
 
+/*
+  Write the header and copy the body of a received message. Both
+  receive paths build the header here, so that the receiver sees the
+  same layout whichever path is taken.
+*/
+static void
+externalize_copyout (mcn_msgheader_t * intmsg,
+		     volatile mcn_msgheader_t * extmsg, mcn_portid_t local,
+		     mcn_portid_t remote, size_t size)
+{
+  extmsg->msgh_bits = intmsg->msgh_bits;
+  extmsg->msgh_remote = remote;
+  extmsg->msgh_local = local;
+  extmsg->msgh_size = size;
+  extmsg->msgh_seqno = 0;	/* XXX: SEQNO */
+  extmsg->msgh_msgid = intmsg->msgh_msgid;
+
+  memcpy ((void *) (extmsg + 1), (void *) (intmsg + 1),
+	  size - sizeof (mcn_msgheader_t));
+}
+
+/*
+  Translate the destination right of a received message to its name
+  in the receiver's space, consuming the reference.
+*/
+static mcn_portid_t
+externalize_local (struct ipcspace *ps, mcn_msgheader_t * intmsg)
+{
+  mcn_portid_t local;
+  struct portref local_pref = ipcport_to_portref (&intmsg->msgh_local);
+
+  local = ipcspace_lookup (ps, portref_unsafe_get (&local_pref));
+  portref_consume (&local_pref);
+  return local;
+}
+
 static mcn_msgioret_t
 externalize (struct ipcspace *ps, mcn_msgheader_t * intmsg,
 	     volatile mcn_msgheader_t * extmsg, size_t size)
@@ -428,9 +465,7 @@ externalize (struct ipcspace *ps, mcn_msgheader_t * intmsg,
   assert (size >= sizeof (mcn_msgheader_t));
   assert (size <= MSGBUF_SIZE);
 
-  struct portref local_pref = ipcport_to_portref (&intmsg->msgh_local);
-  local = ipcspace_lookup (ps, portref_unsafe_get (&local_pref));
-  portref_consume (&local_pref);
+  local = externalize_local (ps, intmsg);
 
   remote = MCN_PORTID_NULL;
   if (intmsg->msgh_remote != 0)
@@ -453,21 +488,30 @@ externalize (struct ipcspace *ps, mcn_msgheader_t * intmsg,
 		    size - sizeof (mcn_msgheader_t), MSGITEMOP_EXTERNALIZE);
     }
 
-
-  extmsg->msgh_bits = intmsg->msgh_bits;
-  extmsg->msgh_remote = remote;
-  extmsg->msgh_local = local;
-  extmsg->msgh_size = size;
-  extmsg->msgh_seqno = 0;	/* XXX: SEQNO */
-  extmsg->msgh_msgid = intmsg->msgh_msgid;
-
-  memcpy ((void *) (extmsg + 1), (void *) (intmsg + 1),
-	  size - sizeof (mcn_msgheader_t));
-
+  externalize_copyout (intmsg, extmsg, local, remote, size);
   return MSGIO_SUCCESS;
 }
 
+/*
+  Externalize a message with no reply port and no rights or memory in
+  the body, such as short messages, notifications and alarms. Only
+  the destination right needs translating, exactly as externalize()
+  does.
+*/
+static bool
+externalize_simple (struct ipcspace *ps, mcn_msgheader_t * intmsg,
+		    volatile mcn_msgheader_t * extmsg, size_t size)
+{
+  mcn_portid_t local;
+
+  if ((intmsg->msgh_remote != 0)
+      || (intmsg->msgh_bits & MCN_MSGBITS_COMPLEX))
+    return false;
 
+  local = externalize_local (ps, intmsg);
+  externalize_copyout (intmsg, extmsg, local, MCN_PORTID_NULL, size);
+  return true;
+}
 
 static mcn_msgioret_t
 internalize (struct ipcspace *ps, volatile mcn_msgheader_t * extmsg,
@@ -527,7 +571,7 @@ mcn_msg_send_from_kernel (mcn_msgheader_t * hdr, mcn_msgsize_t size)
 #endif
   int_msg = (mcn_msgheader_t *) kmem_alloc (0, size);
   memcpy (int_msg, hdr, size);
-  rc = port_enqueue (int_msg, 0, true);
+  rc = port_enqueue (int_msg, 0, true, NULL, 0);
   if (rc)
     {
       ipc_intmsg_consume (int_msg);
@@ -536,15 +580,53 @@ mcn_msg_send_from_kernel (mcn_msgheader_t * hdr, mcn_msgsize_t size)
   return rc;
 }
 
+/*
+  Send a msg-accepted notification to `notify`, consuming the
+  reference.
+*/
+void
+ipc_notify_msgaccepted (struct portref *notify, mcn_portid_t name)
+{
+  mcn_return_t rc;
+  mcn_msg_accepted_notification_t *n;
+  const mcn_msgsize_t size = sizeof (mcn_msg_accepted_notification_t);
+
+  n = (mcn_msg_accepted_notification_t *) kmem_alloc (0, size);
+  n->not_header.msgh_bits = MCN_MSGBITS (0, MCN_MSGTYPE_PORTSEND);
+  n->not_header.msgh_size = size;
+  n->not_header.msgh_remote = MCN_PORTID_NULL;
+  n->not_header.msgh_local = portref_to_ipcport (notify);
+  n->not_header.msgh_seqno = 0;
+  n->not_header.msgh_msgid = MCN_NOTIFY_MSG_ACCEPTED;
+  n->not_type = (mcn_msgtype_t) {
+    .msgt_name = MCN_MSGTYPE_PORTNAME,
+    .msgt_size = sizeof (mcn_portid_t) * 8,
+    .msgt_number = 1,
+    .msgt_inline = 1,
+  };
+  n->not_port = name;
+
+  nuxperf_inc (&pmachina_ipc_notify_msgaccepted);
+  rc = port_enqueue (&n->not_header, 0, true, NULL, 0);
+  if (rc)
+    {
+      ipc_intmsg_consume (&n->not_header);
+      kmem_free (0, (vaddr_t) n, size);
+    }
+}
+
 mcn_msgioret_t
 ipc_msgsend (mcn_msgopt_t opt, unsigned long timeout, mcn_portid_t notify)
 {
   mcn_msgioret_t rc;
   struct ipcspace *ps;
+  struct portref notify_pref = PORTREF_NULL;
+  const bool send_notify = !!(opt & MCN_MSGOPT_SEND_NOTIFY);
 
   volatile mcn_msgheader_t *ext_msg =
     (volatile mcn_msgheader_t *) cur_kmsgbuf ();
   const mcn_msgsize_t ext_size = ext_msg->msgh_size;
+  const mcn_portid_t ext_dest = ext_msg->msgh_remote;
 
   if ((ext_size < sizeof (mcn_msgheader_t)) || (ext_size > MSGBUF_SIZE))
     {
@@ -558,11 +640,29 @@ ipc_msgsend (mcn_msgopt_t opt, unsigned long timeout, mcn_portid_t notify)
 
   mcn_msgheader_t *int_msg = (mcn_msgheader_t *) kmem_alloc (0, ext_size);
   ps = task_getipcspace (cur_task ());
+  if (send_notify)
+    {
+      /*
+	The notify port can be named by a send right, or by a receive
+	right we make a send right from.
+      */
+      rc = ipcspace_resolve (ps, MCN_MSGTYPE_COPYSEND, notify, &notify_pref);
+      if (rc)
+	rc = ipcspace_resolve (ps, MCN_MSGTYPE_MAKESEND, notify,
+			       &notify_pref);
+      if (rc)
+	{
+	  task_putipcspace (cur_task (), ps);
+	  kmem_free (0, (vaddr_t) int_msg, ext_size);
+	  return MSGIO_SEND_INVALID_NOTIFY;
+	}
+    }
   rc = internalize (ps, ext_msg, int_msg, ext_size);
   task_putipcspace (cur_task (), ps);
   if (rc)
     {
       nuxperf_inc (&pmachina_ipc_send_internfailed);
+      portref_consume (&notify_pref);
       kmem_free (0, (vaddr_t) int_msg, ext_size);
       return rc;
     }
@@ -571,7 +671,18 @@ ipc_msgsend (mcn_msgopt_t opt, unsigned long timeout, mcn_portid_t notify)
   message_debug (int_msg);
 #endif
 
-  rc = port_enqueue (int_msg, timeout, false);
+  rc = port_enqueue (int_msg, timeout, false,
+		     send_notify ? &notify_pref : NULL, ext_dest);
+  if (rc == MSGIO_SEND_WILL_NOTIFY)
+    {
+      /*
+	The message has been parked on the port, and owns the notify
+	reference now.
+      */
+      nuxperf_inc (&pmachina_ipc_send_willnotify);
+      return rc;
+    }
+  portref_consume (&notify_pref);
   if (rc)
     {
       mcn_msgioret_t rc2;
@@ -597,6 +708,61 @@ ipc_msgsend (mcn_msgopt_t opt, unsigned long timeout, mcn_portid_t notify)
   return MSGIO_SUCCESS;
 }
 
+/*
+  Short send.
+
+  Build the internal message directly from the syscall arguments,
+  skipping the message buffer and the internalization of the header
+  and body. There's no room for a timeout: a full port makes the
+  sender wait and retry, as a normal send with no timeout.
+
+  The destination can be a send right or a receive right.
+*/
+mcn_msgioret_t
+ipc_msgsend_short (mcn_portid_t dest, mcn_msgid_t msgid,
+		   const unsigned long *words)
+{
+  mcn_msgioret_t rc;
+  struct ipcspace *ps;
+  struct portref dest_pref;
+  mcn_msgshort_t *msg;
+
+  ps = task_getipcspace (cur_task ());
+  rc = ipcspace_resolve (ps, MCN_MSGTYPE_COPYSEND, dest, &dest_pref);
+  if (rc)
+    rc = ipcspace_resolve (ps, MCN_MSGTYPE_MAKESEND, dest, &dest_pref);
+  task_putipcspace (cur_task (), ps);
+  if (rc)
+    return MSGIO_SEND_INVALID_DEST;
+
+  msg = (mcn_msgshort_t *) kmem_alloc (0, sizeof (mcn_msgshort_t));
+  msg->msgs_header.msgh_bits = MCN_MSGBITS (0, MCN_MSGTYPE_PORTSEND);
+  msg->msgs_header.msgh_size = sizeof (mcn_msgshort_t);
+  msg->msgs_header.msgh_remote = MCN_PORTID_NULL;
+  msg->msgs_header.msgh_local = portref_to_ipcport (&dest_pref);
+  msg->msgs_header.msgh_seqno = 0;
+  msg->msgs_header.msgh_msgid = msgid;
+  msg->msgs_type = (mcn_msgtype_t) {
+    .msgt_name = MCN_MSGTYPE_INT64,
+    .msgt_size = sizeof (unsigned long) * 8,
+    .msgt_number = MCN_MSGSHORT_WORDS,
+    .msgt_inline = 1,
+  };
+  memcpy (msg->msgs_words, words, sizeof (msg->msgs_words));
+
+  rc = port_enqueue (&msg->msgs_header, 0, false, NULL, 0);
+  if (rc)
+    {
+      nuxperf_inc (&pmachina_ipc_send_enqueuefailed);
+      ipc_intmsg_consume (&msg->msgs_header);
+      kmem_free (0, (vaddr_t) msg, sizeof (mcn_msgshort_t));
+      return rc;
+    }
+
+  nuxperf_inc (&pmachina_ipc_send_short);
+  return MSGIO_SUCCESS;
+}
+
 mcn_msgioret_t
 ipc_msgrecv (mcn_portid_t recv_port, mcn_msgopt_t opt, unsigned long timeout,
 	     mcn_portid_t notify)
@@ -606,6 +772,28 @@ ipc_msgrecv (mcn_portid_t recv_port, mcn_msgopt_t opt, unsigned long timeout,
   struct portref recv_pref;
   mcn_msgheader_t *intmsg;
 
+  if (opt & MCN_MSGOPT_RECV_SPIN)
+    {
+      /*
+	Poll the port without holding the IPC space lock. The port is
+	resolved again below, as the receive right might have moved.
+      */
+      ps = task_getipcspace (cur_task ());
+      rc = ipcspace_resolve_receive (ps, recv_port, &recv_pref);
+      task_putipcspace (cur_task (), ps);
+      if (rc == KERN_SUCCESS)
+	{
+	  uint64_t nsecs = MCN_MSGOPT_RECV_SPIN_GETUSECS (opt) * 1000;
+
+	  if (nsecs == 0)
+	    nsecs = IPC_RECV_SPIN_NSECS;
+	  else if (nsecs > IPC_RECV_SPIN_MAX_NSECS)
+	    nsecs = IPC_RECV_SPIN_MAX_NSECS;
+	  (void) port_spin (portref_unsafe_get (&recv_pref), nsecs);
+	  portref_consume (&recv_pref);
+	}
+    }
+
   ps = task_getipcspace (cur_task ());
   rc = ipcspace_resolve_receive (ps, recv_port, &recv_pref);
   if (rc)
@@ -631,7 +819,12 @@ ipc_msgrecv (mcn_portid_t recv_port, mcn_msgopt_t opt, unsigned long timeout,
   message_debug (intmsg);
 #endif
 
-  externalize (ps, intmsg, (volatile mcn_msgheader_t *) cur_kmsgbuf (), size);
+  if (externalize_simple (ps, intmsg,
+			  (volatile mcn_msgheader_t *) cur_kmsgbuf (), size))
+    nuxperf_inc (&pmachina_ipc_recv_simple);
+  else
+    externalize (ps, intmsg, (volatile mcn_msgheader_t *) cur_kmsgbuf (),
+		 size);
 
 #ifdef IPC_DEBUG
   message_debug ((mcn_msgheader_t *) cur_kmsgbuf ());
@@ -245,6 +245,10 @@ _exec_op (struct ipcspace *ps, uint8_t op, bool send_only,
     case MCN_MSGTYPE_MOVERECV:
       assert (!send_only);
       pe->normal.recv = false;
+      /*
+	The status slot belongs to this task.
+      */
+      port_unbind_status (REF_GET (pe->portref));
       if (pe->normal.send_count == 0)
 	{
 	  *pref = REF_MOVE (pe->portref);
@@ -70,7 +70,7 @@ ipc_kern_exec (void)
       KIPC_PRINT ("KERNEL SERVER OUTPUT");
       message_debug (reply);
 #endif
-      rc = port_enqueue (reply, 0, true);
+      rc = port_enqueue (reply, 0, true, NULL, 0);
       KIPC_PRINT ("KERNEL SERVER ENQUEUE: %d\n", rc);
       if (rc)
 	{
@@ -65,6 +65,12 @@ threadref_to_threadport (struct threadref thread)
   return portref_to_ipcport (&pr);
 }
 
+static inline void
+threadref_deallocate (struct threadref thread)
+{
+  threadref_consume (&thread);
+}
+
 typedef struct vmobjref vmobjref_t;
 
 static inline struct vmobjref
@@ -125,4 +131,36 @@ host_to_nameport (struct host *host)
   return portref_to_ipcport (&pr);
 }
 
+typedef struct procset *procsetptr_t;
+
+static inline struct procset *
+port_to_procset (ipc_port_t port)
+{
+  return port_get_procset (ipcport_unsafe_get (port));
+}
+
+static inline ipc_port_t
+procset_to_port (struct procset *ps)
+{
+  struct portref pr;
+  pr = procset_getport (ps);
+  return portref_to_ipcport (&pr);
+}
+
+typedef struct clock *clockptr_t;
+
+static inline struct clock *
+port_to_clock (ipc_port_t port)
+{
+  return port_get_clock (ipcport_unsafe_get (port));
+}
+
+static inline ipc_port_t
+clock_to_port (struct clock *clock)
+{
+  struct portref pr;
+  pr = clock_getport (clock);
+  return portref_to_ipcport (&pr);
+}
+
 #endif
@@ -0,0 +1,200 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#include <machina/error.h>
+
+#include "internal.h"
+#include "machina_server.h"
+
+/*
+  Machina kernel interface (machina.defs).
+*/
+
+mcn_return_t
+thread_set_priority (threadref_t thread, int priority)
+{
+  if (threadref_isnull (&thread))
+    return KERN_INVALID_ARGUMENT;
+
+  if ((priority < MCN_PRI_RT_LEVELS) || (priority >= MCN_PRI_LEVELS))
+    return KERN_INVALID_ARGUMENT;
+
+  thread_setpriority (threadref_unsafe_get (&thread), priority);
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+thread_set_realtime (hostptr_t host, threadref_t thread, int priority,
+		     long period, long computation)
+{
+  if ((host == NULL) || threadref_isnull (&thread))
+    return KERN_INVALID_ARGUMENT;
+
+  if ((priority < 0) || (period <= 0) || (computation <= 0))
+    return KERN_INVALID_ARGUMENT;
+
+  return thread_setrealtime (threadref_unsafe_get (&thread), priority,
+			     period, computation);
+}
+
+mcn_return_t
+thread_rt_info (threadref_t thread, long *deadline_misses, long *demotions)
+{
+  struct thread *th;
+
+  if (threadref_isnull (&thread))
+    return KERN_INVALID_ARGUMENT;
+
+  th = threadref_unsafe_get (&thread);
+  *deadline_misses = __atomic_load_n (&th->rt_misses, __ATOMIC_RELAXED);
+  *demotions = __atomic_load_n (&th->rt_demotions, __ATOMIC_RELAXED);
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+thread_set_vtalarm (threadref_t thread, long cpu_time, long period,
+		    mcn_portid_t alarm_port)
+{
+  struct portref port;
+
+  if (threadref_isnull (&thread) || (cpu_time < 0) || (period < 0))
+    return KERN_INVALID_ARGUMENT;
+
+  if ((cpu_time != 0) && ipcport_isnull (alarm_port))
+    return KERN_INVALID_ARGUMENT;
+
+  /* The request's reference is consumed with the request. */
+  port = portref_fromraw (ipcport_unsafe_get (alarm_port));
+  thread_setvtalrm (threadref_unsafe_get (&thread), cpu_time, period, &port);
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+thread_info (threadref_t thread, long *user_time, long *system_time)
+{
+  uint64_t utime, stime;
+
+  if (threadref_isnull (&thread))
+    return KERN_INVALID_ARGUMENT;
+
+  thread_times (threadref_unsafe_get (&thread), &utime, &stime);
+  *user_time = utime;
+  *system_time = stime;
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+task_info (taskref_t task, long *user_time, long *system_time)
+{
+  uint64_t utime, stime;
+
+  if (taskref_isnull (&task))
+    return KERN_INVALID_ARGUMENT;
+
+  task_times (taskref_unsafe_get (&task), &utime, &stime);
+  *user_time = utime;
+  *system_time = stime;
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+host_sched_stats (hostptr_t host, int cpu, mcn_schedstats_t *stats)
+{
+  if ((host == NULL) || (cpu < 0))
+    return KERN_INVALID_ARGUMENT;
+
+  return sched_stats (cpu, stats);
+}
+
+mcn_return_t
+host_procset_default (hostptr_t host, procsetptr_t *pset)
+{
+  if (host == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  *pset = procset_default ();
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+host_procset_create (hostptr_t host, procsetptr_t *pset)
+{
+  if (host == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  return procset_alloc (pset);
+}
+
+mcn_return_t
+procset_assign_cpu (hostptr_t host, procsetptr_t pset, int cpu)
+{
+  if ((host == NULL) || (pset == NULL) || (cpu < 0))
+    return KERN_INVALID_ARGUMENT;
+
+  return procset_setcpu (pset, cpu);
+}
+
+mcn_return_t
+procset_assign_task (procsetptr_t pset, taskref_t task)
+{
+  if ((pset == NULL) || taskref_isnull (&task))
+    return KERN_INVALID_ARGUMENT;
+
+  return procset_settask (pset, taskref_unsafe_get (&task));
+}
+
+mcn_return_t
+procset_assign_thread (procsetptr_t pset, threadref_t thread)
+{
+  if ((pset == NULL) || threadref_isnull (&thread))
+    return KERN_INVALID_ARGUMENT;
+
+  return procset_setthread (pset, threadref_unsafe_get (&thread));
+}
+
+mcn_return_t
+procset_info (procsetptr_t pset, long *cpus)
+{
+  if (pset == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  *cpus = __atomic_load_n (&pset->cpus, __ATOMIC_RELAXED);
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+host_get_clock (hostptr_t host, clockptr_t *clock)
+{
+  if (host == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  *clock = clock_system ();
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+clock_get_time (clockptr_t clock, long *time)
+{
+  if (clock == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  *time = clock_now ();
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+clock_alarm (clockptr_t clock, long alarm_time, mcn_portid_t alarm_port)
+{
+  struct portref port;
+
+  if ((clock == NULL) || (alarm_time < 0) || ipcport_isnull (alarm_port))
+    return KERN_INVALID_ARGUMENT;
+
+  /* The request's reference is consumed with the request. */
+  port = portref_fromraw (ipcport_unsafe_get (alarm_port));
+  /* Kernel requests are served before the sender returns to user. */
+  return clock_setalarm (clock, cur_task (), alarm_time, &port);
+}
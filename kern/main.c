@@ -17,13 +17,6 @@
 
 cpumask_t idlemap;
 
-void
-cpu_kick (void)
-{
-  nuxperf_inc (&pmachina_cpu_kick);
-  once_cpumask (idlemap, cpu_ipi(i));
-}
-
 struct taskref bootstrap_taskref;
 static int smp_sync = 0;
 
@@ -65,6 +58,19 @@ start_timer (void)
   timer_register (&timer, 1L * 1000 * 1000 * 1000);
 }
 
+/*
+  Allocate the per-CPU data, aligned to a cache line.
+*/
+static struct mcncpu *
+mcncpu_alloc (void)
+{
+  uintptr_t va;
+
+  va = (uintptr_t) kmem_alloc (0, sizeof (struct mcncpu) + CACHELINE_SIZE);
+  va = (va + CACHELINE_SIZE - 1) & ~((uintptr_t) CACHELINE_SIZE - 1);
+  return (struct mcncpu *) va;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -81,15 +87,21 @@ main (int argc, char *argv[])
   thread_init ();
   port_init ();
   ipcspace_init ();
+  host_init ();
+  procset_init ();
 
   /* Initialise per-CPU data. */
-  cpu_setdata ((void *) kmem_alloc (0, sizeof (struct mcncpu)));
+  cpu_setdata (mcncpu_alloc ());
   msgq_init (&cur_cpu ()->kernel_msgq);
   cur_cpu ()->idle = thread_idle ();
   cur_cpu ()->thread = cur_cpu ()->idle;
   TAILQ_INIT (&cur_cpu ()->dead_threads);
   TAILQ_INIT (&cur_cpu ()->dead_tasks);
+  timer_init (&cur_cpu ()->reap_timer);
+  timer_cpu_init (&cur_cpu ()->timers);
+  sched_cpu_init (cur_cpu ());
   atomic_cpumask_set (&idlemap, cpu_id ());
+  clock_init ();
 
   task_bootstrap (&bootstrap_taskref);
 
@@ -117,22 +129,146 @@ main_ap (void)
   while (!__sync_bool_compare_and_swap (&smp_sync, 1, 1));
 
   /* Initialise per-CPU data. */
-  cpu_setdata ((void *) kmem_alloc (0, sizeof (struct mcncpu)));
+  cpu_setdata (mcncpu_alloc ());
   msgq_init (&cur_cpu ()->kernel_msgq);
   cur_cpu ()->idle = thread_idle ();
   cur_cpu ()->thread = cur_cpu ()->idle;
   TAILQ_INIT (&cur_cpu ()->dead_threads);
   TAILQ_INIT (&cur_cpu ()->dead_tasks);
+  timer_init (&cur_cpu ()->reap_timer);
+  timer_cpu_init (&cur_cpu ()->timers);
+  sched_cpu_init (cur_cpu ());
   atomic_cpumask_set (&idlemap, cpu_id ());
 
   return EXIT_IDLE;
 }
 
+/*
+  Reaper.
+
+  Destroyed threads and tasks are queued on the CPU that destroyed
+  them. Threads are cheap to tear down: when returning to a thread,
+  up to REAPER_BUDGET_NSECS are spent on them, and at least one is
+  reaped to guarantee progress. Tasks can be expensive, so they are
+  left for when the CPU is idle, where the queues are drained unless
+  work arrives. A CPU that is never idle reaps a task every
+  REAPER_STARVE_NSECS.
+*/
+static void
+reaper_starved (void *opq)
+{
+  cpu_pending_set (cur_cpu (), CPU_PENDING_REAP);
+}
+
+static void
+reaper_run (bool idle)
+{
+  struct mcncpu *cpu = cur_cpu ();
+  uint64_t now = timer_gettime ();
+  uint64_t end = now + REAPER_BUDGET_NSECS;
+  struct thread *th;
+  struct task *t;
+
+  while ((th = TAILQ_FIRST (&cpu->dead_threads)) != NULL)
+    {
+      TAILQ_REMOVE (&cpu->dead_threads, th, sched_list);
+      _task_destroy_thread (th);
+      nuxperf_inc (&pmachina_reaper_threads);
+
+      if (TAILQ_EMPTY (&cpu->dead_threads))
+	break;
+      if (idle ? sched_pending () : (timer_gettime () >= end))
+	{
+	  nuxperf_inc (&pmachina_reaper_deferred);
+	  cpu_pending_set (cpu, CPU_PENDING_REAP);
+	  return;
+	}
+    }
+
+  if (TAILQ_EMPTY (&cpu->dead_tasks))
+    {
+      if (cpu->reap_stamp != 0)
+	timer_remove (&cpu->reap_timer);
+      cpu->reap_stamp = 0;
+      return;
+    }
+
+  if (!idle)
+    {
+      if (cpu->reap_stamp == 0)
+	{
+	  cpu->reap_stamp = now;
+	  cpu->reap_timer.valid = 1;
+	  cpu->reap_timer.opq = NULL;
+	  cpu->reap_timer.handler = reaper_starved;
+	  timer_register (&cpu->reap_timer, REAPER_STARVE_NSECS);
+	}
+      if (now - cpu->reap_stamp < REAPER_STARVE_NSECS)
+	return;
+
+      t = TAILQ_FIRST (&cpu->dead_tasks);
+      TAILQ_REMOVE (&cpu->dead_tasks, t, task_list);
+      _task_cleanup (t);
+      nuxperf_inc (&pmachina_reaper_tasks);
+      nuxperf_inc (&pmachina_reaper_starved);
+      /* Wait again for idle time before the next one. */
+      cpu->reap_stamp = 0;
+      return;
+    }
+
+  while (!sched_pending ()
+	 && ((t = TAILQ_FIRST (&cpu->dead_tasks)) != NULL))
+    {
+      TAILQ_REMOVE (&cpu->dead_tasks, t, task_list);
+      _task_cleanup (t);
+      nuxperf_inc (&pmachina_reaper_tasks);
+    }
+  if (!TAILQ_EMPTY (&cpu->dead_tasks))
+    nuxperf_inc (&pmachina_reaper_deferred);
+  else if (cpu->reap_stamp != 0)
+    {
+      timer_remove (&cpu->reap_timer);
+      cpu->reap_stamp = 0;
+    }
+}
+
+/*
+  Called on every entry from user mode or idle. The user context is
+  left in the entry frame: copying it to the thread is deferred to
+  the scheduler, and only done if the thread is switched out.
+*/
+void
+kern_enter (uctxt_t *uctxt)
+{
+  struct thread *th = cur_thread ();
+
+  if (!thread_isidle (th))
+    th->uframe = uctxt;
+  sched_acct_enter ();
+}
+
 uctxt_t *
 kern_return (void)
 {
+  struct mcncpu *cpu = cur_cpu ();
   uctxt_t *uctxt;
 
+  /*
+    Fast path: nothing to do, and no reason to reschedule. Resume
+    the current thread straight from its entry frame.
+  */
+  if (!thread_isidle (cpu->thread)
+      && (__atomic_load_n (&cpu->pending, __ATOMIC_ACQUIRE) == 0)
+      && !__atomic_load_n (&cpu->resched, __ATOMIC_RELAXED))
+    {
+      nuxperf_inc (&pmachina_kern_fastret);
+      sched_acct_exit ();
+      return thread_uctxt (cpu->thread);
+    }
+
+  /* Anything made pending from now on is caught next time. */
+  (void) __atomic_exchange_n (&cpu->pending, 0, __ATOMIC_ACQUIRE);
+
   ipc_kern_exec ();
 
   void memctrl_run_clock ();
@@ -140,32 +276,23 @@ kern_return (void)
 
   uctxt = sched_next ();
 
-  {
-    struct thread *th, *tmp;
-    TAILQ_FOREACH_SAFE(th, &cur_cpu ()->dead_threads, sched_list, tmp)
-      {
-	TAILQ_REMOVE(&cur_cpu ()->dead_threads, th, sched_list);
-	_task_destroy_thread(th);
-      }
-  }
-
-  {
-    struct task *t, *tmp;
-    TAILQ_FOREACH_SAFE(t, &cur_cpu ()->dead_tasks, task_list, tmp)
-      {
-	TAILQ_REMOVE(&cur_cpu ()->dead_tasks, t, task_list);
-	_task_cleanup(t);
-      }
-  }
+  reaper_run (thread_isidle (cur_thread ()));
+
+  /*
+    Reaping might have made threads runnable on this CPU without
+    an IPI. Don't halt on them.
+  */
+  if (thread_isidle (cur_thread ()) && sched_pending ())
+    uctxt = sched_next ();
 
+  sched_acct_exit ();
   return uctxt;
 }
 
 uctxt_t *
 entry_ipi (uctxt_t * uctxt)
 {
-  if (cur_thread ()->uctxt != UCTXT_IDLE)
-    *cur_thread ()->uctxt = *uctxt;
+  kern_enter (uctxt);
 
   return kern_return ();
 }
@@ -173,8 +300,7 @@ entry_ipi (uctxt_t * uctxt)
 uctxt_t *
 entry_alarm (uctxt_t * uctxt)
 {
-  if (cur_thread ()->uctxt != UCTXT_IDLE)
-    *cur_thread ()->uctxt = *uctxt;
+  kern_enter (uctxt);
 
   timer_run ();
 
@@ -192,8 +318,7 @@ entry_alarm (uctxt_t * uctxt)
 uctxt_t *
 entry_ex (uctxt_t * uctxt, unsigned ex)
 {
-  if (cur_thread ()->uctxt != UCTXT_IDLE)
-    *cur_thread ()->uctxt = *uctxt;
+  kern_enter (uctxt);
 
   info ("Exception %d", ex);
   uctxt_print (uctxt);
@@ -206,8 +331,7 @@ entry_pf (uctxt_t * uctxt, vaddr_t va, hal_pfinfo_t pfi)
 {
   mcn_vmprot_t req;
 
-  if (cur_thread ()->uctxt != UCTXT_IDLE)
-    *cur_thread ()->uctxt = *uctxt;
+  kern_enter (uctxt);
 
   //  printf ("cur_thread(): %p\n", cur_thread ());
   //  info ("CPU #%d Pagefault at %08lx (%x)", cpu_id (), va, pfi);
@@ -241,10 +365,10 @@ entry_pf (uctxt_t * uctxt, vaddr_t va, hal_pfinfo_t pfi)
 uctxt_t *
 entry_irq (uctxt_t * uctxt, unsigned irq, bool lvl)
 {
-  if (cur_thread ()->uctxt != UCTXT_IDLE)
-    *cur_thread ()->uctxt = *uctxt;
+  kern_enter (uctxt);
 
   info ("IRQ %d", irq);
+  sched_acct_exit ();
   return uctxt;
 }
 
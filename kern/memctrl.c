@@ -105,6 +105,9 @@ void
 memctrl_tick_one (void)
 {
   __atomic_fetch_add (&_memctrl_pending_ticks, 1, __ATOMIC_RELAXED);
+  /* Can be called before the per-CPU data is set up. */
+  if (cur_cpu () != NULL)
+    cpu_pending_set (cur_cpu (), CPU_PENDING_CLOCK);
 }
 
 void
@@ -139,8 +139,21 @@ msgbuf_free (struct umap *umap, struct msgbuf_zone *z, struct msgbuf *mb)
 }
 
 
+/*
+  Free the kernel side of a message buffer whose user mapping has
+  already been destroyed.
+*/
+void
+msgbuf_kfree (struct msgbuf *mb)
+{
+  kmap_ensure_range (mb->kaddr, MSGBUF_SIZE, 0);
+  MSGBUF_PRINT("MSGBUF: FREEING %lx (%ld bytes)\n", mb->kaddr, MSGBUF_SIZE);
+  kva_free (mb->kaddr, MSGBUF_SIZE);
+}
+
 bool
-msgbuf_alloc (struct umap *umap, struct msgbuf_zone *z, struct msgbuf *mb)
+msgbuf_alloc (struct umap *umap, struct msgbuf_zone *z, struct msgbuf *mb,
+	      bool uwr)
 {
   long uidx;
   vaddr_t uaddr, kaddr;
@@ -164,7 +177,7 @@ msgbuf_alloc (struct umap *umap, struct msgbuf_zone *z, struct msgbuf *mb)
       return false;
     }
 
-  if (!share_kva (kaddr, MSGBUF_SIZE, umap, uaddr, true))
+  if (!share_kva (kaddr, MSGBUF_SIZE, umap, uaddr, uwr))
     {
       kmap_ensure_range (kaddr, MSGBUF_SIZE, 0);
       kva_free (kaddr, MSGBUF_SIZE);
@@ -178,6 +191,35 @@ msgbuf_alloc (struct umap *umap, struct msgbuf_zone *z, struct msgbuf *mb)
   return true;
 }
 
+/*
+  Map read-only an existing kernel message buffer `kaddr` in a user
+  message buffer slot. The kernel side is not owned by `mb`, and must
+  not be freed with it.
+*/
+bool
+msgbuf_share (struct umap *umap, struct msgbuf_zone *z, vaddr_t kaddr,
+	      struct msgbuf *mb)
+{
+  long uidx;
+  vaddr_t uaddr;
+
+  uidx = zone_alloc (z, 1);
+  if (uidx == -1)
+    return false;
+
+  uaddr = (vaddr_t) uidx << MSGBUF_SHIFT;
+  if (!share_kva (kaddr, MSGBUF_SIZE, umap, uaddr, false))
+    {
+      zone_free (z, uidx, 1);
+      return false;
+    }
+
+  mb->uaddr = uaddr;
+  mb->kaddr = kaddr;
+
+  return true;
+}
+
 void
 msgbuf_destroy (struct msgbuf_zone *z)
 {
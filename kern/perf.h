@@ -7,24 +7,69 @@
 #endif
 
 NUXPERF(pmachina_sysc_msgbuf);
+NUXPERF(pmachina_sysc_status_page);
+NUXPERF(pmachina_sysc_time_page);
 NUXPERF(pmachina_sysc_msgrecv);
 NUXPERF(pmachina_sysc_msgsend);
+NUXPERF(pmachina_sysc_msgsend_short);
 NUXPERF(pmachina_sysc_reply_port);
 NUXPERF(pmachina_sysc_task_self);
+NUXPERF(pmachina_sysc_port_status);
+NUXPERF(pmachina_sysc_thread_self);
+NUXPERF(pmachina_sysc_host_self);
+NUXPERF(pmachina_sysc_thread_switch);
 NUXPERF(pmachina_sysc_vm_map);
 NUXPERF(pmachina_sysc_vm_allocate);
 NUXPERF(pmachina_sysc_vm_region);
 
 NUXPERF(pmachina_cpu_kick);
 
+NUXPERF(pmachina_sched_wakeup);
+NUXPERF(pmachina_sched_steal);
+NUXPERF(pmachina_sched_migrate);
+NUXPERF(pmachina_sched_aged);
+NUXPERF(pmachina_sched_preempt);
+NUXPERF(pmachina_sched_affine);
+NUXPERF(pmachina_sched_handoff);
+NUXPERF(pmachina_sched_pset_move);
+NUXPERF(pmachina_sched_uctxt_save);
+NUXPERF(pmachina_kern_fastret);
+NUXPERF(pmachina_timer_expired);
+NUXPERF(pmachina_timer_cascaded);
+NUXPERF(pmachina_timer_coalesced);
+NUXPERF(pmachina_clock_updates);
+NUXPERF(pmachina_clock_alarms);
+NUXPERF(pmachina_clock_alarms_sent);
+NUXPERF(pmachina_clock_alarms_failed);
+NUXPERF(pmachina_thread_vtalarms);
+NUXPERF(pmachina_sched_rt_admitted);
+NUXPERF(pmachina_sched_rt_rejected);
+NUXPERF(pmachina_sched_rt_preempt);
+NUXPERF(pmachina_sched_rt_miss);
+NUXPERF(pmachina_sched_rt_demoted);
+NUXPERF(pmachina_sched_idle_spinhit);
+NUXPERF(pmachina_sched_idle_spinmiss);
+NUXPERF(pmachina_sched_idle_halt);
+
+NUXPERF(pmachina_reaper_threads);
+NUXPERF(pmachina_reaper_tasks);
+NUXPERF(pmachina_reaper_deferred);
+NUXPERF(pmachina_reaper_starved);
+
 NUXPERF(pmachina_ipc_send_invaliddata);
 NUXPERF(pmachina_ipc_send_internfailed);
 NUXPERF(pmachina_ipc_send_enqueuefailed);
 NUXPERF(pmachina_ipc_send_success);
+NUXPERF(pmachina_ipc_send_willnotify);
+NUXPERF(pmachina_ipc_notify_msgaccepted);
+NUXPERF(pmachina_ipc_send_short);
 
 NUXPERF(pmachina_ipc_recv_invalidname);
 NUXPERF(pmachina_ipc_recv_dequeuefailed);
 NUXPERF(pmachina_ipc_recv_success);
+NUXPERF(pmachina_ipc_recv_simple);
+NUXPERF(pmachina_ipc_recv_spinhit);
+NUXPERF(pmachina_ipc_recv_spinmiss);
 
 NUXPERF(pmachina_vmobj_faults);
 NUXPERF(pmachina_vmobj_fault_empty);
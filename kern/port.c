@@ -85,6 +85,8 @@ msgq_enq (msgqueue_t * msgq, mcn_msgheader_t * msgh)
     return KERN_RESOURCE_SHORTAGE;
 
   msgq_entry->msgh = msgh;
+  msgq_entry->notify = 0;
+  msgq_entry->notify_name = MCN_PORTID_NULL;
   TAILQ_INSERT_TAIL (msgq, msgq_entry, queue);
   return KERN_SUCCESS;
 }
@@ -114,35 +116,141 @@ msgq_discard (msgqueue_t *msgq)
     }
 }
 
+static void
+msgq_discard_parked (msgqueue_t *msgq)
+{
+  struct msgq_entry *n, *t;
+
+  TAILQ_FOREACH_SAFE(n, msgq, queue, t)
+    {
+      struct portref notify = ipcport_to_portref (&n->notify);
+
+      TAILQ_REMOVE (msgq, n, queue);
+      portref_consume (&notify);
+      ipc_intmsg_consume (n->msgh);
+      slab_free(n);
+    }
+}
+
 void
 portqueue_init (struct port_queue *queue, unsigned limit)
 {
   msgq_init (&queue->msgq);
+  msgq_init (&queue->parkq);
   waitq_init (&queue->recv_waitq);
   waitq_init (&queue->send_waitq);
   queue->entries = 0;
   queue->capacity = limit;
+  queue->parked = 0;
+  queue->status = NULL;
+  queue->status_map = NULL;
+  queue->status_slot = 0;
+}
+
+/*
+  Publish the number of pending messages in the port status page.
+*/
+static inline void
+portqueue_status_update (struct port_queue *pq)
+{
+  if (pq->status == NULL)
+    return;
+
+  __atomic_store_n (&pq->status->ps_pending, pq->entries, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&pq->status->ps_gen, 1, __ATOMIC_RELEASE);
+}
+
+static void
+portqueue_status_unbind (struct port_queue *pq)
+{
+  const unsigned slot = pq->status_slot;
+
+  if (pq->status == NULL)
+    return;
+
+  __atomic_store_n (&pq->status->ps_pending, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&pq->status->ps_gen, 1, __ATOMIC_RELEASE);
+  __atomic_and_fetch (&pq->status_map[slot / LONG_BIT],
+		      ~(1UL << (slot % LONG_BIT)), __ATOMIC_RELAXED);
+  pq->status = NULL;
+  pq->status_map = NULL;
+  pq->status_slot = 0;
+}
+
+static mcn_msgioret_t
+portqueue_park (struct port_queue *pq, mcn_msgheader_t * msgh,
+		struct portref *notify, mcn_portid_t notify_name)
+{
+  struct msgq_entry *msgq_entry;
+
+  /*
+    Do not let non-blocking senders grow the queue without limit.
+  */
+  if (pq->parked >= pq->capacity)
+    return MSGIO_SEND_NO_NOTIFY;
+
+  msgq_entry = slab_alloc (&msgqs);
+  if (msgq_entry == NULL)
+    return MSGIO_SEND_NO_NOTIFY;
+
+  msgq_entry->msgh = msgh;
+  msgq_entry->notify = portref_to_ipcport (notify);
+  msgq_entry->notify_name = notify_name;
+  TAILQ_INSERT_TAIL (&pq->parkq, msgq_entry, queue);
+  pq->parked++;
+  return MSGIO_SEND_WILL_NOTIFY;
+}
+
+/*
+  Move the oldest parked message into the queue, if any. Returns the
+  notification to be sent, which must be done with the port unlocked.
+*/
+static bool
+portqueue_unpark (struct port_queue *pq, struct portref *notify,
+		  mcn_portid_t *notify_name)
+{
+  struct msgq_entry *msgq_entry = TAILQ_FIRST (&pq->parkq);
+
+  if (msgq_entry == NULL)
+    return false;
+
+  TAILQ_REMOVE (&pq->parkq, msgq_entry, queue);
+  pq->parked--;
+
+  *notify = ipcport_to_portref (&msgq_entry->notify);
+  *notify_name = msgq_entry->notify_name;
+  msgq_entry->notify_name = MCN_PORTID_NULL;
+  TAILQ_INSERT_TAIL (&pq->msgq, msgq_entry, queue);
+  pq->entries++;
+  portqueue_status_update (pq);
+  return true;
 }
 
 mcn_msgioret_t
 portqueue_enq (struct port_queue *pq, unsigned long timeout, bool force,
-	       mcn_msgheader_t * msgh)
+	       mcn_msgheader_t * msgh, struct portref *notify,
+	       mcn_portid_t notify_name)
 {
   if (!force
       && (!waitq_empty (&pq->send_waitq) || (pq->capacity == pq->entries)))
     {
+      if (notify != NULL)
+	return portqueue_park (pq, msgh, notify, notify_name);
+
       thread_wait (&pq->send_waitq, timeout);
       return KERN_RETRY;
     }
   msgq_enq (&pq->msgq, msgh);
   pq->entries++;
+  portqueue_status_update (pq);
   thread_wakeone (&pq->recv_waitq);
   return MSGIO_SUCCESS;
 }
 
 mcn_return_t
 portqueue_deq (struct port_queue *pq, unsigned long timeout,
-	       mcn_msgheader_t ** msghp)
+	       mcn_msgheader_t ** msghp, struct portref *notify,
+	       mcn_portid_t *notify_name)
 {
   if (!msgq_deq (&pq->msgq, msghp))
     {
@@ -150,12 +258,20 @@ portqueue_deq (struct port_queue *pq, unsigned long timeout,
       return KERN_RETRY;
     }
   pq->entries--;
-  thread_wakeone (&pq->send_waitq);
+  portqueue_status_update (pq);
+
+  /*
+    Parked messages have precedence over blocked senders: they were
+    there first, and their senders are not going to retry.
+  */
+  if (!portqueue_unpark (pq, notify, notify_name))
+    thread_wakeone (&pq->send_waitq);
   return KERN_SUCCESS;
 }
 
 mcn_msgioret_t
-port_enqueue (mcn_msgheader_t * msgh, unsigned long timeout, bool force)
+port_enqueue (mcn_msgheader_t * msgh, unsigned long timeout, bool force,
+	      struct portref *notify, mcn_portid_t notify_name)
 {
   mcn_return_t rc;
   struct port *port;
@@ -169,6 +285,7 @@ port_enqueue (mcn_msgheader_t * msgh, unsigned long timeout, bool force)
     {
     case PORT_KERNEL:
       rc = msgq_enq (&cur_cpu ()->kernel_msgq, msgh);
+      cpu_pending_set (cur_cpu (), CPU_PENDING_KMSG);
       break;
 
     case PORT_DEAD:
@@ -176,7 +293,8 @@ port_enqueue (mcn_msgheader_t * msgh, unsigned long timeout, bool force)
       break;
 
     case PORT_QUEUE:
-      rc = portqueue_enq (&port->queue, timeout, force, msgh);
+      rc = portqueue_enq (&port->queue, timeout, force, msgh, notify,
+			  notify_name);
       break;
 
     default:
@@ -193,6 +311,8 @@ port_dequeue (struct port *port, unsigned long timeout,
 	      mcn_msgheader_t ** msghp)
 {
   mcn_return_t rc;
+  struct portref notify = PORTREF_NULL;
+  mcn_portid_t notify_name;
 
   port_lock (port);
   switch (port->type)
@@ -210,14 +330,83 @@ port_dequeue (struct port *port, unsigned long timeout,
 
     case PORT_QUEUE:
       {
-	rc = portqueue_deq (&port->queue, timeout, msghp);
+	rc = portqueue_deq (&port->queue, timeout, msghp, &notify,
+			    &notify_name);
 	port_unlock (port);
 	break;
       }
     }
+
+  if (!portref_isnull (&notify))
+    ipc_notify_msgaccepted (&notify, notify_name);
+  return rc;
+}
+
+/*
+  Poll an empty queue port for `nsecs` nanoseconds, without taking
+  the port lock. Returns true if a message arrived in the meantime.
+
+  This is only a hint: the queue has to be checked again with the
+  lock held.
+*/
+bool
+port_spin (struct port *port, uint64_t nsecs)
+{
+  uint64_t end;
+
+  if (__atomic_load_n (&port->type, __ATOMIC_RELAXED) != PORT_QUEUE)
+    return false;
+
+  end = timer_gettime () + nsecs;
+  while (__atomic_load_n (&port->queue.entries, __ATOMIC_RELAXED) == 0)
+    {
+      if (timer_gettime () >= end)
+	{
+	  nuxperf_inc (&pmachina_ipc_recv_spinmiss);
+	  return false;
+	}
+      cpu_relax ();
+    }
+  nuxperf_inc (&pmachina_ipc_recv_spinhit);
+  return true;
+}
+
+/*
+  Bind a queue port to a slot of the receiver's status page. The
+  slot must have been reserved in `map`.
+*/
+mcn_return_t
+port_bind_status (struct port *port, mcn_portstatus_t *status,
+		  unsigned long *map, unsigned slot)
+{
+  mcn_return_t rc;
+
+  port_lock (port);
+  if (port->type != PORT_QUEUE)
+    rc = KERN_INVALID_NAME;
+  else if (port->queue.status != NULL)
+    rc = KERN_NAME_EXISTS;
+  else
+    {
+      port->queue.status = status;
+      port->queue.status_map = map;
+      port->queue.status_slot = slot;
+      portqueue_status_update (&port->queue);
+      rc = KERN_SUCCESS;
+    }
+  port_unlock (port);
   return rc;
 }
 
+void
+port_unbind_status (struct port *port)
+{
+  port_lock (port);
+  if (port->type == PORT_QUEUE)
+    portqueue_status_unbind (&port->queue);
+  port_unlock (port);
+}
+
 static void *
 port_getkobj (struct port *port, enum kern_objtype kot)
 {
@@ -322,6 +511,30 @@ port_get_host_from_ctrl (struct port *port)
   return host;
 }
 
+struct procset *
+port_get_procset (struct port *port)
+{
+  struct procset *ps;
+
+  port_lock (port);
+  ps = port_getkobj (port, KOT_PROCSET);
+  port_unlock (port);
+
+  return ps;
+}
+
+struct clock *
+port_get_clock (struct port *port)
+{
+  struct clock *clock;
+
+  port_lock (port);
+  clock = port_getkobj (port, KOT_CLOCK);
+  port_unlock (port);
+
+  return clock;
+}
+
 void
 port_alloc_kernel (void *obj, enum kern_objtype kot, struct portref *portref)
 {
@@ -372,13 +585,14 @@ port_unlink_queue (struct portref *portref)
   struct port *p = portref_unsafe_get(portref);
 
   port_lock (p);
-  spinlock (&p->lock);
   assert (p->type == PORT_QUEUE);
 
-  while (thread_wakeone (&p->queue.send_waitq));
-  while (thread_wakeone (&p->queue.recv_waitq));
+  thread_wakeall (&p->queue.send_waitq);
+  thread_wakeall (&p->queue.recv_waitq);
 
   msgq_discard(&p->queue.msgq);
+  msgq_discard_parked(&p->queue.parkq);
+  portqueue_status_unbind (&p->queue);
 
   p->type = PORT_DEAD;
   port_unlock (p);
@@ -398,6 +612,6 @@ void
 port_init (void)
 {
   slab_register (&msgqs, "MSGQS", sizeof (struct msgq_entry), NULL, 0);
-  slab_register (&ports, "PORTS", sizeof (struct port), NULL, 0);
+  slab_register (&ports, "PORTS", sizeof (struct port), NULL, 1);
 
 }
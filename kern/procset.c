@@ -0,0 +1,148 @@
+/*
+  MACHINA: a NUX-based Mach clone.
+  Copyright (C) 2024 Gianluca Guida, glguida@tlbflush.org
+  SPDX-License-Identifier:	BSD-2-Clause
+*/
+
+#include <machina/error.h>
+
+#include "internal.h"
+
+/*
+  Processor Sets.
+
+  Every CPU belongs to exactly one processor set, and every task and
+  thread is assigned to one. Threads only run on the CPUs of their
+  set. All CPUs start in the default set, which can't be emptied.
+
+  Sets are never destroyed. A set that has been given a CPU can't
+  lose its last one, so that the threads assigned to it can always
+  run.
+*/
+
+static lock_t procsets_lock;
+static struct procset procsets[PROCSET_MAX];
+
+void
+procset_init (void)
+{
+  struct procset *ps = &procsets[0];
+
+  spinlock_init (&procsets_lock);
+  ps->cpus = 0;
+  ps->active = true;
+  port_alloc_kernel ((void *) ps, KOT_PROCSET, &ps->self);
+}
+
+struct procset *
+procset_default (void)
+{
+  return &procsets[0];
+}
+
+struct portref
+procset_getport (struct procset *ps)
+{
+  return portref_dup (&ps->self);
+}
+
+/*
+  Add a starting CPU to the default set.
+*/
+void
+procset_addcpu (struct mcncpu *cpu)
+{
+  struct procset *ps = procset_default ();
+
+  spinlock (&procsets_lock);
+  cpu->pset = ps;
+  atomic_cpumask_set (&ps->cpus, cpu->id);
+  spinunlock (&procsets_lock);
+}
+
+mcn_return_t
+procset_alloc (struct procset **psp)
+{
+  unsigned i;
+  struct procset *ps;
+
+  spinlock (&procsets_lock);
+  for (i = 0; i < PROCSET_MAX; i++)
+    if (!procsets[i].active)
+      break;
+  if (i == PROCSET_MAX)
+    {
+      spinunlock (&procsets_lock);
+      return KERN_RESOURCE_SHORTAGE;
+    }
+  ps = &procsets[i];
+  ps->cpus = 0;
+  ps->active = true;
+  spinunlock (&procsets_lock);
+
+  port_alloc_kernel ((void *) ps, KOT_PROCSET, &ps->self);
+  *psp = ps;
+  return KERN_SUCCESS;
+}
+
+/*
+  Move a CPU to a set. Fails if that would leave the CPU's current
+  set empty, or if real-time threads are bound to the CPU.
+*/
+mcn_return_t
+procset_setcpu (struct procset *ps, unsigned cpu)
+{
+  mcn_return_t rc;
+  struct procset *old;
+  struct mcncpu *c = sched_cpu (cpu);
+
+  if (c == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  spinlock (&procsets_lock);
+  old = c->pset;
+  if (old == ps)
+    rc = KERN_SUCCESS;
+  else if ((old->cpus & ~(1UL << cpu)) == 0)
+    rc = KERN_FAILURE;
+  else if (!sched_cpu_setpset (c, ps))
+    rc = KERN_FAILURE;
+  else
+    {
+      atomic_cpumask_clear (&old->cpus, cpu);
+      atomic_cpumask_set (&ps->cpus, cpu);
+      rc = KERN_SUCCESS;
+    }
+  spinunlock (&procsets_lock);
+
+  return rc;
+}
+
+/*
+  Assign a thread to a set. The set must have at least a CPU.
+*/
+mcn_return_t
+procset_setthread (struct procset *ps, struct thread *th)
+{
+  if (__atomic_load_n (&ps->cpus, __ATOMIC_RELAXED) == 0)
+    return KERN_FAILURE;
+
+  thread_lock (th);
+  _sched_setpset (th, ps);
+  thread_unlock (th);
+  return KERN_SUCCESS;
+}
+
+/*
+  Assign a task and all its threads to a set. Threads created later
+  inherit the task's set.
+*/
+mcn_return_t
+procset_settask (struct procset *ps, struct task *t)
+{
+  if (__atomic_load_n (&ps->cpus, __ATOMIC_RELAXED) == 0)
+    return KERN_FAILURE;
+
+  task_setpset (t, ps);
+  return KERN_SUCCESS;
+}
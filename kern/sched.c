@@ -4,6 +4,8 @@
   SPDX-License-Identifier:	BSD-2-Clause
 */
 
+#include <machina/error.h>
+
 #include "internal.h"
 
 #if WAITQ_LOCK_MEASURE
@@ -13,21 +15,573 @@ DEFINE_LOCK_MEASURE(waitq_lock_msr);
 #if SCHED_LOCK_MEASURE
 DEFINE_LOCK_MEASURE(sched_lock_msr);
 
-#define sched_lock() spinlock_measured (&sched_lock, &sched_lock_msr)
-#define sched_unlock() spinunlock_measured (&sched_lock, &sched_lock_sched)
+#define runq_lock(_rq) spinlock_measured (&(_rq)->lock, &sched_lock_msr)
+#define runq_unlock(_rq) spinunlock_measured (&(_rq)->lock, &sched_lock_msr)
 
 #else
 
-#define sched_lock() spinlock (&sched_lock)
-#define sched_unlock() spinunlock (&sched_lock)
+#define runq_lock(_rq) spinlock (&(_rq)->lock)
+#define runq_unlock(_rq) spinunlock (&(_rq)->lock)
 
 #endif
 
 
-static lock_t sched_lock = {0, };
-/**INDENT-OFF**/
-static TAILQ_HEAD (thread_list, thread) runnable_threads = TAILQ_HEAD_INITIALIZER (runnable_threads);
-/**INDENT-ON**/
+/*
+  Per-CPU data of all the CPUs started.
+*/
+static struct mcncpu *mcncpus[MAXCPUS];
+
+/*
+  Run Queues.
+
+  Every CPU has its own run queue. A runnable thread is queued on the
+  run queue of the last CPU it ran on, `th->cpu`, and `th->runq` is
+  set while it is queued. `th->runq` is protected by the run queue
+  lock.
+
+  A thread can be removed from a run queue by a CPU picking it while
+  its lock is not held. Threads are only run if, once locked, they
+  are still runnable and not queued again.
+
+  Each run queue has a FIFO per priority level, and a bitmap of the
+  non-empty levels. Level 0 is the highest priority.
+
+  Real-time threads are always queued on the CPU they have been
+  admitted on, `th->rt_cpu`, and are never stolen.
+
+  Threads are only queued on CPUs of their processor set, and only
+  stolen by CPUs of the same set. A CPU that picks a thread that has
+  been moved to another set since it was queued sends it there.
+*/
+#define SCHED_RT_MASK ((1U << MCN_PRI_RT_LEVELS) - 1)
+
+static inline bool
+sched_isrt (struct thread *th)
+{
+  return th->rt_period != 0;
+}
+
+static inline void
+_runq_remove (struct runq *rq, struct thread *th)
+{
+  TAILQ_REMOVE (&rq->queue[th->pri], th, sched_list);
+  if (TAILQ_EMPTY (&rq->queue[th->pri]))
+    rq->bitmap &= ~(1U << th->pri);
+  th->runq = NULL;
+  rq->nr--;
+}
+
+static void
+runq_insert (struct thread *th)
+{
+  struct runq *rq;
+
+  cpumask_t cpus;
+
+  if (sched_isrt (th))
+    th->cpu = th->rt_cpu;
+  cpus = __atomic_load_n (&th->pset->cpus, __ATOMIC_RELAXED);
+  if ((cpus != 0) && !(cpus & (1UL << th->cpu)))
+    th->cpu = __builtin_ctzl (cpus);
+  rq = &mcncpus[th->cpu]->runq;
+
+  runq_lock (rq);
+  assert (th->runq == NULL);
+  th->runq_stamp = timer_gettime ();
+  TAILQ_INSERT_TAIL (&rq->queue[th->pri], th, sched_list);
+  rq->bitmap |= 1U << th->pri;
+  th->runq = rq;
+  rq->nr++;
+  runq_unlock (rq);
+}
+
+static bool
+runq_remove (struct thread *th)
+{
+  struct runq *rq;
+
+  while ((rq = __atomic_load_n (&th->runq, __ATOMIC_RELAXED)) != NULL)
+    {
+      runq_lock (rq);
+      if (th->runq == rq)
+	{
+	  _runq_remove (rq, th);
+	  runq_unlock (rq);
+	  return true;
+	}
+      runq_unlock (rq);
+    }
+
+  return false;
+}
+
+/*
+  Pick the first thread of the highest priority level among
+  `mask`.
+
+  Aging: if the oldest thread of a lower level has been waiting for
+  more than SCHED_AGING_NSECS, pick it instead. Real-time threads
+  don't age and are not passed by aged threads.
+*/
+static struct thread *
+runq_pop (struct runq *rq, uint32_t mask)
+{
+  uint32_t levels;
+  uint64_t now;
+  struct thread *th, *old;
+
+  runq_lock (rq);
+  levels = rq->bitmap & mask;
+  if (levels == 0)
+    {
+      runq_unlock (rq);
+      return NULL;
+    }
+
+  th = TAILQ_FIRST (&rq->queue[__builtin_ctz (levels)]);
+  levels &= levels - 1;
+  if ((levels != 0) && (th->pri >= MCN_PRI_RT_LEVELS))
+    {
+      now = timer_gettime ();
+      while (levels != 0)
+	{
+	  old = TAILQ_FIRST (&rq->queue[__builtin_ctz (levels)]);
+	  if (now - old->runq_stamp > SCHED_AGING_NSECS)
+	    {
+	      nuxperf_inc (&pmachina_sched_aged);
+	      th = old;
+	      break;
+	    }
+	  levels &= levels - 1;
+	}
+    }
+  _runq_remove (rq, th);
+  runq_unlock (rq);
+  return th;
+}
+
+/*
+  Steal a thread from the busiest run queue of our processor set.
+*/
+static struct thread *
+runq_steal (void)
+{
+  unsigned i, nr, max = 0;
+  struct runq *busiest = NULL;
+  struct procset *ps = cur_cpu ()->pset;
+
+  for (i = 0; i < MAXCPUS; i++)
+    {
+      if (i == cpu_id () || mcncpus[i] == NULL
+	  || !procset_hascpu (ps, i))
+	continue;
+
+      nr = __atomic_load_n (&mcncpus[i]->runq.nr, __ATOMIC_RELAXED);
+      if (nr > max)
+	{
+	  max = nr;
+	  busiest = &mcncpus[i]->runq;
+	}
+    }
+
+  if (busiest == NULL)
+    return NULL;
+
+  return runq_pop (busiest, ~SCHED_RT_MASK);
+}
+
+/*
+  Find an idle CPU of its set to run `th`: its last CPU if idle,
+  otherwise the idle CPU closest to it. Returns MAXCPUS if all CPUs
+  of the set are busy.
+*/
+static unsigned
+sched_idle_target (struct thread *th)
+{
+  unsigned dist, target = MAXCPUS, best = MAXCPUS;
+  cpumask_t idle = idlemap & __atomic_load_n (&th->pset->cpus,
+					      __ATOMIC_RELAXED);
+
+  foreach_cpumask (idle, {
+      dist = i > th->cpu ? i - th->cpu : th->cpu - i;
+      if (dist < best)
+	{
+	  best = dist;
+	  target = i;
+	}
+    });
+
+  return target;
+}
+
+/*
+  Quantum expired: make the CPU reschedule on its way back to user.
+*/
+static void
+sched_quantum_expired (void *opq)
+{
+  struct mcncpu *cpu = (struct mcncpu *) opq;
+
+  __atomic_store_n (&cpu->resched, true, __ATOMIC_RELAXED);
+  if (cpu->id != cpu_id ())
+    cpu_ipi (cpu->id);
+}
+
+static void
+sched_quantum_arm (struct thread *th)
+{
+  struct timer *t = &cur_cpu ()->quantum;
+
+  timer_remove (t);
+  t->valid = 1;
+  t->opq = cur_cpu ();
+  t->handler = sched_quantum_expired;
+  if (sched_isrt (th))
+    timer_register (t, th->rt_computation);
+  else
+    timer_register (t, SCHED_QUANTUM_NSECS (th->pri));
+}
+
+/*
+  Real-Time Class.
+
+  A real-time thread declares a period and the computation time it
+  needs in each. A thread is admitted on the first CPU, starting
+  from its current one, whose real-time utilization stays below
+  SCHED_RT_UTIL_MAX, and is bound to it. Each time it is resumed
+  a new period starts, and a period ends when it blocks again.
+
+  Only CPUs of the thread's processor set are considered. A CPU
+  with real-time threads admitted can't change set.
+
+  A thread still running past its period is counted as a deadline
+  miss. A thread that used more than SCHED_RT_WATCHDOG times its
+  computation time in a period is demoted to MCN_PRI_USER.
+
+  `rt_util` of a CPU is protected by its run queue lock.
+*/
+static bool
+sched_rt_admit (struct thread *th, unsigned util)
+{
+  unsigned i, cpu;
+  struct runq *rq;
+
+  for (i = 0; i < MAXCPUS; i++)
+    {
+      cpu = (th->cpu + i) % MAXCPUS;
+      if (mcncpus[cpu] == NULL)
+	continue;
+
+      rq = &mcncpus[cpu]->runq;
+      runq_lock (rq);
+      if ((mcncpus[cpu]->pset == th->pset)
+	  && (mcncpus[cpu]->rt_util + util <= SCHED_RT_UTIL_MAX))
+	{
+	  mcncpus[cpu]->rt_util += util;
+	  runq_unlock (rq);
+	  th->rt_cpu = cpu;
+	  th->rt_util = util;
+	  return true;
+	}
+      runq_unlock (rq);
+    }
+
+  return false;
+}
+
+/*
+  Leave the real-time class. Called with the thread locked.
+*/
+static void
+sched_rt_leave (struct thread *th)
+{
+  struct runq *rq = &mcncpus[th->rt_cpu]->runq;
+
+  runq_lock (rq);
+  mcncpus[th->rt_cpu]->rt_util -= th->rt_util;
+  runq_unlock (rq);
+  th->rt_period = 0;
+}
+
+static void
+sched_rt_release (struct thread *th, uint64_t now)
+{
+  th->rt_release = now;
+  th->rt_cputime = th->utime + th->stime;
+}
+
+/*
+  A real-time thread is blocking: its period is over.
+*/
+static void
+sched_rt_complete (struct thread *th, uint64_t now)
+{
+  if (now - th->rt_release > th->rt_period)
+    {
+      nuxperf_inc (&pmachina_sched_rt_miss);
+      th->rt_misses++;
+    }
+}
+
+/*
+  A real-time thread is being preempted: check it's within budget.
+*/
+static void
+sched_rt_watchdog (struct thread *th)
+{
+  uint64_t used = th->utime + th->stime - th->rt_cputime;
+
+  if (used <= SCHED_RT_WATCHDOG * th->rt_computation)
+    return;
+
+  nuxperf_inc (&pmachina_sched_rt_demoted);
+  th->rt_demotions++;
+  sched_rt_leave (th);
+  th->pri = MCN_PRI_USER;
+}
+
+/*
+  A real-time thread has been queued on `cpu`. Make it preempt the
+  current thread there if that has a lower priority. Returns true
+  if `cpu` needs an IPI.
+*/
+static bool
+sched_rt_preempt (struct mcncpu *cpu, struct thread *th)
+{
+  unsigned cur_pri = __atomic_load_n (&cpu->cur_pri, __ATOMIC_RELAXED);
+
+  if (cur_pri == MCN_PRI_LEVELS)
+    return true;
+
+  if (cur_pri <= th->pri)
+    return false;
+
+  nuxperf_inc (&pmachina_sched_rt_preempt);
+  __atomic_store_n (&cpu->resched, true, __ATOMIC_RELAXED);
+  return true;
+}
+
+/*
+  Set a thread in the real-time class. Called with the thread
+  locked.
+
+  If the thread was already real-time, its previous reservation is
+  released first: if the new one can't be admitted, the thread is
+  left at MCN_PRI_USER.
+*/
+mcn_return_t
+_sched_setrt (struct thread *th, unsigned pri, uint64_t period,
+	      uint64_t computation)
+{
+  unsigned util;
+
+  if ((pri >= MCN_PRI_RT_LEVELS) || (period == 0) || (computation == 0)
+      || (computation > period))
+    return KERN_INVALID_ARGUMENT;
+
+  util = (computation * 1000 + period - 1) / period;
+
+  if (sched_isrt (th))
+    {
+      sched_rt_leave (th);
+      _sched_setpri (th, MCN_PRI_USER);
+    }
+
+  if (!sched_rt_admit (th, util))
+    {
+      nuxperf_inc (&pmachina_sched_rt_rejected);
+      return KERN_RESOURCE_SHORTAGE;
+    }
+
+  nuxperf_inc (&pmachina_sched_rt_admitted);
+  th->rt_period = period;
+  th->rt_computation = computation;
+  sched_rt_release (th, timer_gettime ());
+  _sched_setpri (th, pri);
+  return KERN_SUCCESS;
+}
+
+/*
+  Adaptive Idle Spin.
+
+  Halting and being woken up by an IPI is expensive compared to a
+  short IPC round trip. Before halting, a CPU whose recent idle
+  periods have been short polls for a while, advertising itself
+  with `idle_spinning`. A waker that clears the flag has queued work
+  for it, and doesn't need to send an IPI.
+
+  The window is twice the average idle period, and no spin happens
+  if that is longer than SCHED_IDLE_SPIN_NSECS.
+*/
+static void
+sched_idle_sample (struct mcncpu *cpu, uint64_t nsecs)
+{
+  /* Don't let a single long idle period disable spinning for long. */
+  if (nsecs > 4 * SCHED_IDLE_SPIN_NSECS)
+    nsecs = 4 * SCHED_IDLE_SPIN_NSECS;
+  cpu->idle_avg = cpu->idle_avg - cpu->idle_avg / 8 + nsecs / 8;
+}
+
+static bool
+sched_idle_spin (void)
+{
+  struct mcncpu *cpu = cur_cpu ();
+  uint64_t start, end, window;
+  bool hit;
+
+  window = 2 * cpu->idle_avg;
+  if (window > SCHED_IDLE_SPIN_NSECS)
+    return false;
+
+  start = timer_gettime ();
+  end = start + window;
+  __atomic_store_n (&cpu->idle_spinning, true, __ATOMIC_SEQ_CST);
+  if (!thread_isidle (cur_thread ()))
+    atomic_cpumask_set (&idlemap, cpu_id ());
+
+  while (__atomic_load_n (&cpu->idle_spinning, __ATOMIC_RELAXED)
+	 && (timer_gettime () < end));
+
+  /* If a waker cleared the flag first, it has queued a thread for us. */
+  hit = !__atomic_exchange_n (&cpu->idle_spinning, false, __ATOMIC_SEQ_CST);
+  if (!hit)
+    {
+      nuxperf_inc (&pmachina_sched_idle_spinmiss);
+      return false;
+    }
+
+  nuxperf_inc (&pmachina_sched_idle_spinhit);
+  if (!thread_isidle (cur_thread ()))
+    {
+      atomic_cpumask_clear (&idlemap, cpu_id ());
+      sched_idle_sample (cpu, timer_gettime () - start);
+    }
+  return true;
+}
+
+/*
+  CPU Time Accounting.
+
+  Each CPU keeps the time of the last accounting event. On kernel
+  entry the time since then is charged to the current thread as user
+  time; on kernel exit and on context switch as system time. Time
+  spent in the idle thread is not charged to anyone.
+*/
+void
+sched_acct_enter (void)
+{
+  struct mcncpu *cpu = cur_cpu ();
+  struct thread *th = cpu->thread;
+  uint64_t now = timer_gettime ();
+
+  if (!thread_isidle (th))
+    __atomic_store_n (&th->utime, th->utime + (now - cpu->acct_stamp),
+		      __ATOMIC_RELAXED);
+  cpu->acct_stamp = now;
+}
+
+static void
+sched_acct_system (struct mcncpu *cpu, struct thread *th, uint64_t now)
+{
+  if (!thread_isidle (th))
+    __atomic_store_n (&th->stime, th->stime + (now - cpu->acct_stamp),
+		      __ATOMIC_RELAXED);
+  cpu->acct_stamp = now;
+}
+
+void
+sched_acct_exit (void)
+{
+  sched_acct_system (cur_cpu (), cur_thread (), timer_gettime ());
+}
+
+/*
+  Scheduler Statistics.
+*/
+static void
+sched_latency (struct mcncpu *cpu, uint64_t nsecs)
+{
+  unsigned bucket;
+
+  bucket = nsecs == 0 ? 0 : 63 - __builtin_clzll (nsecs);
+  if (bucket >= MCN_SCHEDSTATS_BUCKETS)
+    bucket = MCN_SCHEDSTATS_BUCKETS - 1;
+  cpu->latency[bucket]++;
+}
+
+mcn_return_t
+sched_stats (unsigned cpu, mcn_schedstats_t *stats)
+{
+  struct mcncpu *c;
+
+  if (cpu >= MAXCPUS || (c = mcncpus[cpu]) == NULL)
+    return KERN_INVALID_ARGUMENT;
+
+  stats->ss_switches = __atomic_load_n (&c->nr_switches, __ATOMIC_RELAXED);
+  stats->ss_migrations = __atomic_load_n (&c->nr_migrations,
+					  __ATOMIC_RELAXED);
+  for (unsigned i = 0; i < MCN_SCHEDSTATS_BUCKETS; i++)
+    stats->ss_latency[i] = __atomic_load_n (&c->latency[i],
+					    __ATOMIC_RELAXED);
+  return KERN_SUCCESS;
+}
+
+void
+sched_cpu_init (struct mcncpu *cpu)
+{
+  spinlock_init (&cpu->runq.lock);
+  for (unsigned i = 0; i < MCN_PRI_LEVELS; i++)
+    TAILQ_INIT (&cpu->runq.queue[i]);
+  cpu->runq.bitmap = 0;
+  cpu->runq.nr = 0;
+  cpu->id = cpu_id ();
+  procset_addcpu (cpu);
+  cpu->resched = false;
+  cpu->pending = 0;
+  cpu->idle_spinning = false;
+  cpu->cur_pri = MCN_PRI_LEVELS;
+  cpu->idle_start = timer_gettime ();
+  cpu->idle_avg = SCHED_IDLE_SPIN_NSECS;
+  cpu->acct_stamp = timer_gettime ();
+  cpu->rt_util = 0;
+  cpu->handoff = THREADREF_NULL;
+  cpu->nr_switches = 0;
+  cpu->nr_migrations = 0;
+  memset (cpu->latency, 0, sizeof (cpu->latency));
+  timer_init (&cpu->quantum);
+  mcncpus[cpu_id ()] = cpu;
+}
+
+struct mcncpu *
+sched_cpu (unsigned cpu)
+{
+  if (cpu >= MAXCPUS)
+    return NULL;
+  return mcncpus[cpu];
+}
+
+/*
+  Move a CPU to a processor set. Fails if real-time threads are
+  admitted on it. Threads of the old set queued on it are moved
+  when picked.
+*/
+bool
+sched_cpu_setpset (struct mcncpu *cpu, struct procset *ps)
+{
+  runq_lock (&cpu->runq);
+  if (cpu->rt_util != 0)
+    {
+      runq_unlock (&cpu->runq);
+      return false;
+    }
+  cpu->pset = ps;
+  runq_unlock (&cpu->runq);
+
+  __atomic_store_n (&cpu->resched, true, __ATOMIC_RELAXED);
+  if (cpu->id != cpu_id ())
+    cpu_ipi (cpu->id);
+  return true;
+}
 
 void
 _sched_add (struct thread *th)
@@ -44,13 +598,12 @@ _sched_suspend (struct thread *th)
 
     case SCHED_RUNNING:
       th->sched_op.op_suspend = true;
+      cpu_pending_set (mcncpus[th->cpu], CPU_PENDING_SCHED);
       break;
 
     case SCHED_RUNNABLE:
       assert (th->suspend == 0);
-      sched_lock ();
-      TAILQ_REMOVE (&runnable_threads, th, sched_list);
-      sched_unlock ();
+      (void) runq_remove (th);
       th->status = SCHED_STOPPED;
       th->suspend = 1;
       break;
@@ -70,10 +623,11 @@ _sched_suspend (struct thread *th)
     }
 }
 
-void
-_sched_resume (struct thread *th)
+static void
+sched_resume (struct thread *th, bool affine, cpumask_t *kick)
 {
   bool resumed = false;
+  unsigned target = MAXCPUS;
 
   switch (th->status)
     {
@@ -98,9 +652,21 @@ _sched_resume (struct thread *th)
       if (--th->suspend == 0)
 	{
 	  th->status = SCHED_RUNNABLE;
-	  sched_lock ();
-	  TAILQ_INSERT_TAIL (&runnable_threads, th, sched_list);
-	  sched_unlock ();
+	  if (sched_isrt (th))
+	    {
+	      sched_rt_release (th, timer_gettime ());
+	      target = th->rt_cpu;
+	    }
+	  else if (affine && procset_hascpu (th->pset, cpu_id ()))
+	    {
+	      nuxperf_inc (&pmachina_sched_affine);
+	      target = cpu_id ();
+	    }
+	  else
+	    target = sched_idle_target (th);
+	  if (target != MAXCPUS)
+	    th->cpu = target;
+	  runq_insert (th);
 	  resumed = true;
 	}
       break;
@@ -117,8 +683,187 @@ _sched_resume (struct thread *th)
       break;
     }
 
+  /*
+    Wake up only the CPU the thread has been queued on. If we are
+    that CPU, ask for a reschedule: the kernel return path skips the
+    scheduler unless something is pending. If the target is spinning
+    in idle, clearing its flag is enough.
+
+    Real-time threads are queued on their CPU even if busy, and
+    only need an IPI if they preempt it.
+  */
   if (resumed)
-    cpu_kick ();
+    nuxperf_inc (&pmachina_sched_wakeup);
+  if (resumed && sched_isrt (th)
+      && !sched_rt_preempt (mcncpus[target], th))
+    resumed = false;
+  if (resumed && (target == cpu_id ()))
+    cpu_pending_set (cur_cpu (), CPU_PENDING_SCHED);
+  else if (resumed && (target != MAXCPUS)
+	   && !__atomic_exchange_n (&mcncpus[target]->idle_spinning, false,
+				    __ATOMIC_SEQ_CST))
+    {
+      if (kick != NULL)
+	cpumask_set (kick, target);
+      else
+	{
+	  nuxperf_inc (&pmachina_cpu_kick);
+	  cpu_ipi (target);
+	}
+    }
+}
+
+/*
+  Send the IPIs collected by a batch of wakeups.
+*/
+void
+sched_kick (cpumask_t kick)
+{
+  foreach_cpumask (kick, {
+      nuxperf_inc (&pmachina_cpu_kick);
+      cpu_ipi (i);
+    });
+}
+
+/*
+  Queue a runnable thread that has been taken off a run queue of a
+  CPU that is no longer in its set on a CPU of its set.
+*/
+static void
+sched_pset_requeue (struct thread *th)
+{
+  unsigned target;
+
+  nuxperf_inc (&pmachina_sched_pset_move);
+  target = sched_idle_target (th);
+  if (target != MAXCPUS)
+    th->cpu = target;
+  runq_insert (th);
+  if ((th->cpu != cpu_id ())
+      && !__atomic_exchange_n (&mcncpus[th->cpu]->idle_spinning, false,
+			       __ATOMIC_SEQ_CST))
+    {
+      nuxperf_inc (&pmachina_cpu_kick);
+      cpu_ipi (th->cpu);
+    }
+}
+
+/*
+  Move a thread to a processor set. Called with the thread locked.
+
+  A real-time thread admitted on a CPU outside the set leaves the
+  real-time class. A queued thread is moved to a CPU of the set, and
+  a thread running outside it is preempted.
+*/
+void
+_sched_setpset (struct thread *th, struct procset *ps)
+{
+  th->pset = ps;
+
+  if (sched_isrt (th) && !procset_hascpu (ps, th->rt_cpu))
+    {
+      sched_rt_leave (th);
+      _sched_setpri (th, MCN_PRI_USER);
+    }
+
+  switch (th->status)
+    {
+    case SCHED_RUNNABLE:
+      if (!procset_hascpu (ps, th->cpu) && runq_remove (th))
+	sched_pset_requeue (th);
+      break;
+
+    case SCHED_RUNNING:
+      if (!procset_hascpu (ps, th->cpu))
+	{
+	  __atomic_store_n (&mcncpus[th->cpu]->resched, true,
+			    __ATOMIC_RELAXED);
+	  if (th->cpu != cpu_id ())
+	    cpu_ipi (th->cpu);
+	}
+      break;
+
+    default:
+      break;
+    }
+}
+
+void
+_sched_resume (struct thread *th)
+{
+  sched_resume (th, false, NULL);
+}
+
+/*
+  Wake up a thread blocked in a wait queue.
+
+  Threads remember which thread woke them up last. If the thread
+  we're waking up is the one that last woke us, the two are very
+  likely exchanging messages, and we will block soon waiting for
+  its answer: queue it on this CPU, where the message data is still
+  in the cache, instead of waking up another CPU.
+
+  If `kick` is not NULL, the IPI needed is added to it rather than
+  sent, see sched_kick().
+*/
+void
+_sched_wakeup (struct thread *th, cpumask_t *kick)
+{
+  struct thread *curth = cur_thread ();
+  bool affine = false;
+
+  if (thread_isidle (curth))
+    th->waker = NULL;
+  else
+    {
+      affine = (th->waker == curth)
+	&& (__atomic_load_n (&curth->waker, __ATOMIC_RELAXED) == th);
+      th->waker = curth;
+    }
+
+  sched_resume (th, affine, kick);
+}
+
+/*
+  Publish the priority of the thread running on `cpu`. Called with
+  the thread locked: it can't be switched out meanwhile.
+*/
+static void
+sched_publish_pri (struct mcncpu *cpu, struct thread *th)
+{
+  unsigned pri = thread_isidle (th) ? MCN_PRI_LEVELS : th->pri;
+
+  __atomic_store_n (&cpu->cur_pri, pri, __ATOMIC_RELAXED);
+}
+
+/*
+  Change the priority of a thread. Called with the thread locked.
+*/
+void
+_sched_setpri (struct thread *th, unsigned pri)
+{
+  assert (pri < MCN_PRI_LEVELS);
+
+  /* A depressed thread gets its new priority when undepressed. */
+  if (th->depress_pri != MCN_PRI_LEVELS)
+    {
+      th->depress_pri = pri;
+      return;
+    }
+
+  if (sched_isrt (th) && (pri >= MCN_PRI_RT_LEVELS))
+    sched_rt_leave (th);
+
+  if (runq_remove (th))
+    {
+      th->pri = pri;
+      runq_insert (th);
+    }
+  else
+    th->pri = pri;
+
+  if (th->status == SCHED_RUNNING)
+    sched_publish_pri (mcncpus[th->cpu], th);
 }
 
 void
@@ -148,25 +893,34 @@ _sched_abort (struct thread *th)
 void
 _sched_destroy (struct thread *th)
 {
+  if (sched_isrt (th))
+    sched_rt_leave (th);
+  if (th->depress_pri != MCN_PRI_LEVELS)
+    {
+      timer_remove (&th->depress);
+      th->depress_pri = MCN_PRI_LEVELS;
+    }
+
   switch (th->status)
     {
     case SCHED_RUNNING:
       th->sched_op.op_destroy = true;
+      cpu_pending_set (mcncpus[th->cpu], CPU_PENDING_SCHED);
       cpu_ipi(th->cpu);
       break;
 
     case SCHED_RUNNABLE:
-      sched_lock ();
-      TAILQ_REMOVE (&runnable_threads, th, sched_list);
-      sched_unlock ();
+      (void) runq_remove (th);
       th->status = SCHED_REMOVED;
       TAILQ_INSERT_TAIL (&cur_cpu ()->dead_threads, th, sched_list);
+      cpu_pending_set (cur_cpu (), CPU_PENDING_REAP);
       break;
 
     case SCHED_STOPPED:
 
       th->status = SCHED_REMOVED;
       TAILQ_INSERT_TAIL (&cur_cpu ()->dead_threads, th, sched_list);
+      cpu_pending_set (cur_cpu (), CPU_PENDING_REAP);
       break;
 
     case SCHED_REMOVED:
@@ -181,11 +935,155 @@ _sched_destroy (struct thread *th)
     }
 }
 
+/*
+  Directed Yield.
+
+  A thread can ask to give the CPU to another runnable thread. The
+  target is taken off its run queue on the next reschedule of this
+  CPU and run here, whatever its priority, unless it is a real-time
+  thread bound elsewhere, or this would pass real-time threads
+  queued here.
+
+  A thread can also depress its priority to the lowest level, until
+  it runs again or a timeout expires.
+*/
+static struct thread *
+sched_handoff (struct threadref *ref)
+{
+  struct thread *th = threadref_unsafe_get (ref);
+
+  if (th == NULL)
+    return NULL;
+
+  if (!procset_hascpu (th->pset, cpu_id ()))
+    return NULL;
+
+  if (sched_isrt (th) ? (th->rt_cpu != cpu_id ())
+      : ((cur_cpu ()->runq.bitmap & SCHED_RT_MASK) != 0))
+    return NULL;
+
+  if (!runq_remove (th))
+    return NULL;
+
+  thread_lock (th);
+  if ((th->status == SCHED_RUNNABLE) && (th->runq == NULL))
+    {
+      if (procset_hascpu (th->pset, cpu_id ()))
+	{
+	  nuxperf_inc (&pmachina_sched_handoff);
+	  return th;
+	}
+      sched_pset_requeue (th);
+    }
+  thread_unlock (th);
+  return NULL;
+}
+
+/*
+  Hand off the CPU to `ref` on the next reschedule. Consumes the
+  reference.
+*/
+void
+sched_handoff_to (struct threadref *ref)
+{
+  threadref_consume (&cur_cpu ()->handoff);
+  cur_cpu ()->handoff = *ref;
+  *ref = THREADREF_NULL;
+  cpu_pending_set (cur_cpu (), CPU_PENDING_SCHED);
+}
+
+/*
+  End a priority depression. Called with the thread locked.
+*/
+void
+sched_undepress (struct thread *th, bool intimer)
+{
+  unsigned pri = th->depress_pri;
+
+  if (pri == MCN_PRI_LEVELS)
+    return;
+
+  if (!intimer)
+    timer_remove (&th->depress);
+  th->depress_pri = MCN_PRI_LEVELS;
+  _sched_setpri (th, pri);
+}
+
+static void
+sched_depress_expired (void *opq)
+{
+  struct thread *th = (struct thread *) opq;
+
+  thread_lock (th);
+  /* The depression might have ended, and another started. */
+  if (timer_claim (&th->depress))
+    sched_undepress (th, true);
+  thread_unlock (th);
+}
+
+/*
+  Depress the priority of a thread for `nsecs` nanoseconds, or until
+  it runs again. Real-time threads are never depressed. Called with
+  the thread locked.
+*/
+void
+sched_depress (struct thread *th, uint64_t nsecs)
+{
+  struct timer *t = &th->depress;
+  unsigned pri = th->pri;
+
+  if (sched_isrt (th) || (th->depress_pri != MCN_PRI_LEVELS))
+    return;
+
+  _sched_setpri (th, MCN_PRI_LEVELS - 1);
+  th->depress_pri = pri;
+  if (nsecs != 0)
+    {
+      t->valid = 1;
+      t->opq = th;
+      t->handler = sched_depress_expired;
+      timer_register (t, nsecs);
+    }
+}
+
+/*
+  The current thread is being switched out: save its user context
+  from the entry frame before another CPU can pick it. Called with
+  the thread locked.
+*/
+static void
+sched_save_uctxt (struct thread *th)
+{
+  if (th->uframe == NULL)
+    return;
+
+  nuxperf_inc (&pmachina_sched_uctxt_save);
+  *th->uctxt = *th->uframe;
+  th->uframe = NULL;
+}
+
+/*
+  Check if there are threads queued on this CPU.
+*/
+bool
+sched_pending (void)
+{
+  return __atomic_load_n (&cur_cpu ()->runq.nr, __ATOMIC_RELAXED) != 0;
+}
+
 uctxt_t *
 sched_next (void)
 {
   struct thread *curth = cur_thread ();
   struct thread *newth;
+  struct threadref handoff;
+  bool preempt, spun = false;
+  uint64_t now;
+
+  preempt = __atomic_exchange_n (&cur_cpu ()->resched, false,
+				 __ATOMIC_RELAXED);
+  handoff = cur_cpu ()->handoff;
+  cur_cpu ()->handoff = THREADREF_NULL;
 
   thread_lock (curth);
 
@@ -195,68 +1093,129 @@ sched_next (void)
   assert (curth->status == SCHED_RUNNING);
   if (curth->sched_op.op_destroy)
     {
-      if (curth->waitq != NULL)
-	{
-	  waitq_lock (curth->waitq);
-	  TAILQ_REMOVE (&curth->waitq->queue, curth, sched_list);
-	  waitq_unlock (curth->waitq);
-
-	  timer_remove (&curth->timeout);
-	  curth->waitq = NULL;
-	}
+      thread_unwait (curth, false);
+      /* No need to save the context of a dying thread. */
+      curth->uframe = NULL;
       curth->status = SCHED_REMOVED;
       TAILQ_INSERT_TAIL (&cur_cpu ()->dead_threads, curth, sched_list);
+      cpu_pending_set (cur_cpu (), CPU_PENDING_REAP);
       curth->sched_op.op_destroy = false;
     }
   else if (curth->sched_op.op_suspend)
     {
+      if (sched_isrt (curth))
+	sched_rt_complete (curth, timer_gettime ());
+      sched_save_uctxt (curth);
       curth->status = SCHED_STOPPED;
       curth->suspend += 1;
       curth->sched_op.op_suspend = false;
     }
-  else if (curth->sched_op.op_yield)
+  else if (curth->sched_op.op_yield || preempt)
     {
+      if (sched_isrt (curth))
+	sched_rt_watchdog (curth);
+      sched_save_uctxt (curth);
       curth->status = SCHED_RUNNABLE;
-      sched_lock ();
-      TAILQ_INSERT_TAIL (&runnable_threads, curth, sched_list);
-      sched_unlock ();
+      runq_insert (curth);
       curth->sched_op.op_yield = false;
     }
   else
     {
       thread_unlock (curth);
-      return curth->uctxt;
+      threadref_consume (&handoff);
+      /* Not switching: resume straight from the entry frame. */
+      return thread_uctxt (curth);
     }
 
 _skip_sched_ops:
-
-  sched_lock ();
-  if (!TAILQ_EMPTY (&runnable_threads))
+  /*
+    Charge the thread while it is still locked: once unlocked, it can
+    be taken by another CPU, or reaped. Virtual time stops while the
+    thread is switched out.
+  */
+  now = timer_gettime ();
+  sched_acct_system (cur_cpu (), curth, now);
+  if (!thread_isidle (curth))
     {
-      newth = TAILQ_FIRST (&runnable_threads);
-      TAILQ_REMOVE (&runnable_threads, newth, sched_list);
-      sched_unlock ();
+      curth->vtt_offset += now - curth->vtt_rttbase;
+      timer_remove (&curth->vtt_alarm);
     }
-  else
+  thread_unlock (curth);
+
+  /*
+    Pick the next thread: the one we've been asked to hand off to,
+    then from our run queue, then from the busiest one. Exit the
+    loop with the thread locked.
+  */
+  newth = sched_handoff (&handoff);
+  while (newth == NULL)
     {
-      sched_unlock ();
-      newth = cur_cpu ()->idle;
+      newth = runq_pop (&cur_cpu ()->runq, ~0U);
+      if (newth == NULL)
+	{
+	  newth = runq_steal ();
+	  if (newth != NULL)
+	    nuxperf_inc (&pmachina_sched_steal);
+	}
+      if ((newth == NULL) && !spun)
+	{
+	  spun = true;
+	  if (sched_idle_spin ())
+	    continue;
+	}
+      if (newth == NULL)
+	{
+	  newth = cur_cpu ()->idle;
+	  thread_lock (newth);
+	  break;
+	}
+
+      /*
+	The thread might have been suspended or destroyed after we
+	took it off the queue, or even resumed and queued again.
+      */
+      thread_lock (newth);
+      if ((newth->status == SCHED_RUNNABLE) && (newth->runq == NULL))
+	{
+	  if (procset_hascpu (newth->pset, cpu_id ()))
+	    break;
+	  sched_pset_requeue (newth);
+	}
+      thread_unlock (newth);
+      newth = NULL;
     }
 
   if (newth == curth)
     {
+      if (!thread_isidle (curth))
+	{
+	  curth->status = SCHED_RUNNING;
+	  /* Its virtual time has been folded up to `now`. */
+	  curth->vtt_rttbase = now;
+	  _thread_vtalrm_arm (curth);
+	  sched_publish_pri (cur_cpu (), curth);
+	  /* Running again ends a depression, even without a switch. */
+	  if (curth->depress_pri != MCN_PRI_LEVELS)
+	    sched_undepress (curth, false);
+	}
       thread_unlock (curth);
+      if (preempt)
+	sched_quantum_arm (curth);
       goto _skip_resched;
     }
-  thread_unlock (curth);
+
+  if (preempt && !thread_isidle (curth))
+    nuxperf_inc (&pmachina_sched_preempt);
 
   /*
-    Actually switch threads here.
+    Actually switch threads here. `now` is the time curth has been
+    charged up to: the time spent picking newth is charged to it.
   */
   if (thread_isidle (curth))
-    atomic_cpumask_clear (&idlemap, cpu_id ());
-
-  thread_lock (newth);
+    {
+      atomic_cpumask_clear (&idlemap, cpu_id ());
+      sched_idle_sample (cur_cpu (), now - cur_cpu ()->idle_start);
+    }
 
   if (thread_isidle (newth))
     {
@@ -271,21 +1230,45 @@ _skip_sched_ops:
   cur_cpu ()->thread = newth;
 
   if (thread_isidle (newth))
-    atomic_cpumask_set (&idlemap, cpu_id ());
+    {
+      cur_cpu ()->idle_start = now;
+      atomic_cpumask_set (&idlemap, cpu_id ());
+    }
 
   newth->status = SCHED_RUNNING;
-  newth->cpu = cpu_id ();
-  //  newth->vtt_rttbase = timer_gettime ();
-#if 0
-  if (newth->vtt_almdiff)
+  sched_publish_pri (cur_cpu (), newth);
+  if (newth->depress_pri != MCN_PRI_LEVELS)
+    sched_undepress (newth, false);
+  cur_cpu ()->nr_switches++;
+  if (!thread_isidle (newth))
     {
-      thread_vtalrm (newth->vtt_almdiff);
+      /*
+	The run queue stamp is the time the thread became runnable,
+	possibly after `now` if it was queued while we were picking.
+      */
+      sched_latency (cur_cpu (),
+		     now > newth->runq_stamp ? now - newth->runq_stamp : 0);
+      if (newth->cpu != cpu_id ())
+	{
+	  nuxperf_inc (&pmachina_sched_migrate);
+	  cur_cpu ()->nr_migrations++;
+	  newth->cpu = cpu_id ();
+	}
     }
-#endif
+  newth->vtt_rttbase = now;
+  _thread_vtalrm_arm (newth);
   thread_unlock (newth);
 
+  if (thread_isidle (newth))
+    timer_remove (&cur_cpu ()->quantum);
+  else
+    sched_quantum_arm (newth);
+
 _skip_resched:
+  threadref_consume (&handoff);
   assert (cur_thread () == newth);
+  if (thread_isidle (newth))
+    nuxperf_inc (&pmachina_sched_idle_halt);
   return cur_thread ()->uctxt;
 }
 
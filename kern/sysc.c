@@ -23,9 +23,7 @@ entry_sysc (uctxt_t * u,
 {
   long ret = 0;
 
-  if (cur_thread ()->uctxt != UCTXT_IDLE)
-    *cur_thread ()->uctxt = *u;
-
+  kern_enter (u);
 
   switch (a1)
     {
@@ -33,6 +31,28 @@ entry_sysc (uctxt_t * u,
       nuxperf_inc (&pmachina_sysc_msgbuf);
       ret = cur_umsgbuf ();
       break;
+    case __syscall_status_page:
+      {
+	uaddr_t uaddr;
+
+	nuxperf_inc (&pmachina_sysc_status_page);
+	if (task_status_page (cur_task (), &uaddr))
+	  ret = UADDR_INVALID;
+	else
+	  ret = uaddr;
+      }
+      break;
+    case __syscall_time_page:
+      {
+	uaddr_t uaddr;
+
+	nuxperf_inc (&pmachina_sysc_time_page);
+	if (task_time_page (cur_task (), &uaddr))
+	  ret = UADDR_INVALID;
+	else
+	  ret = uaddr;
+      }
+      break;
     case __syscall_msgrecv:
       nuxperf_inc (&pmachina_sysc_msgrecv);
       ret =
@@ -43,6 +63,14 @@ entry_sysc (uctxt_t * u,
       nuxperf_inc (&pmachina_sysc_msgsend);
       ret = ipc_msgsend ((mcn_msgopt_t) a2, a3, (mcn_portid_t) a4);
       break;
+    case __syscall_msgsend_short:
+      {
+	const unsigned long words[MCN_MSGSHORT_WORDS] = { a4, a5, a6, a7 };
+
+	nuxperf_inc (&pmachina_sysc_msgsend_short);
+	ret = ipc_msgsend_short ((mcn_portid_t) a2, (mcn_msgid_t) a3, words);
+      }
+      break;
     case __syscall_reply_port:
       {
 	mcn_return_t rc;
@@ -60,6 +88,29 @@ entry_sysc (uctxt_t * u,
       nuxperf_inc (&pmachina_sysc_task_self);
       ret = task_self ();
       break;
+    case __syscall_thread_self:
+      nuxperf_inc (&pmachina_sysc_thread_self);
+      ret = thread_self ();
+      break;
+    case __syscall_thread_switch:
+      nuxperf_inc (&pmachina_sysc_thread_switch);
+      ret = thread_switch ((mcn_portid_t) a2, a3, a4);
+      break;
+    case __syscall_host_self:
+      nuxperf_inc (&pmachina_sysc_host_self);
+      ret = host_self ();
+      break;
+    case __syscall_port_status:
+      {
+	unsigned slot;
+
+	nuxperf_inc (&pmachina_sysc_port_status);
+	if (task_bind_port_status (cur_task (), (mcn_portid_t) a2, &slot))
+	  ret = -1;
+	else
+	  ret = slot;
+      }
+      break;
 
     default:
       {
@@ -93,6 +144,6 @@ entry_sysc (uctxt_t * u,
       break;
     }
 
-  uctxt_setret (cur_thread ()->uctxt, ret);
+  uctxt_setret (u, ret);
   return kern_return ();
 }
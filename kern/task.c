@@ -17,17 +17,7 @@
 #endif
 
 #if TASK_LOCK_MEASURE
-
 DEFINE_LOCK_MEASURE(task_lock_msr);
-
-#define task_lock(_t) spinlock_measured (&(_t)->lock, &task_lock_msr)
-#define task_unlock(_t) spinunlock_measured (&(_t)->lock, &task_lock_msr)
-
-#else
-
-#define task_lock(_t) spinlock (&(_t)->lock)
-#define task_unlock(_t) spinunlock (&(_t)->lock)
-
 #endif
 
 struct slab tasks;
@@ -114,6 +104,111 @@ task_allocate_port (struct task *t, mcn_portid_t * newid)
   return rc;
 }
 
+static mcn_return_t
+_task_status_page (struct task *t)
+{
+  if (t->status_page.kaddr != 0)
+    return KERN_SUCCESS;
+
+  if (!vmmap_allocmsgbuf (&t->vmmap, &t->status_page, false))
+    {
+      t->status_page.kaddr = 0;
+      return KERN_RESOURCE_SHORTAGE;
+    }
+  memset ((void *) t->status_page.kaddr, 0, MSGBUF_SIZE);
+  return KERN_SUCCESS;
+}
+
+mcn_return_t
+task_status_page (struct task *t, uaddr_t *uaddr)
+{
+  mcn_return_t rc;
+
+  task_lock (t);
+  rc = _task_status_page (t);
+  if (rc == KERN_SUCCESS)
+    *uaddr = t->status_page.uaddr;
+  task_unlock (t);
+  return rc;
+}
+
+/*
+  Map the kernel time page in the task, if not yet mapped.
+*/
+mcn_return_t
+task_time_page (struct task *t, uaddr_t *uaddr)
+{
+  mcn_return_t rc = KERN_SUCCESS;
+
+  task_lock (t);
+  if ((t->time_page.kaddr == 0)
+      && !vmmap_sharemsgbuf (&t->vmmap, clock_timepage (), &t->time_page))
+    {
+      t->time_page.kaddr = 0;
+      rc = KERN_RESOURCE_SHORTAGE;
+    }
+  if (rc == KERN_SUCCESS)
+    *uaddr = t->time_page.uaddr;
+  task_unlock (t);
+  return rc;
+}
+
+/*
+  Bind the port with receive right `name` to a free slot of the
+  task's status page.
+*/
+mcn_return_t
+task_bind_port_status (struct task *t, mcn_portid_t name, unsigned *slotout)
+{
+  unsigned slot;
+  mcn_return_t rc;
+  struct portref portref;
+  struct ipcspace *ps;
+  mcn_portstatus_t *status;
+
+  ps = task_getipcspace (t);
+  rc = _task_status_page (t);
+  if (rc)
+    goto out;
+
+  rc = ipcspace_resolve_receive (ps, name, &portref);
+  if (rc)
+    goto out;
+
+  /*
+    Ports clear their bit with an atomic, under their own lock, when
+    they die: claim and release slots atomically too.
+  */
+  for (slot = 0; slot < MCN_PORTSTATUS_SLOTS; slot++)
+    {
+      unsigned long *word = &t->status_map[slot / LONG_BIT];
+      const unsigned long bit = 1UL << (slot % LONG_BIT);
+
+      if (!(__atomic_fetch_or (word, bit, __ATOMIC_RELAXED) & bit))
+	break;
+    }
+  if (slot == MCN_PORTSTATUS_SLOTS)
+    {
+      portref_consume (&portref);
+      rc = KERN_NO_SPACE;
+      goto out;
+    }
+
+  status = (mcn_portstatus_t *) t->status_page.kaddr + slot;
+  rc = port_bind_status (portref_unsafe_get (&portref), status,
+			 t->status_map, slot);
+  if (rc)
+    __atomic_and_fetch (&t->status_map[slot / LONG_BIT],
+			~(1UL << (slot % LONG_BIT)), __ATOMIC_RELAXED);
+  else
+    *slotout = slot;
+  portref_consume (&portref);
+
+ out:
+  task_putipcspace (t, ps);
+  return rc;
+}
+
 mcn_return_t
 task_vm_map (struct task *t, vaddr_t * addr, size_t size, unsigned long mask,
 	     bool anywhere, struct vmobjref ref, mcn_vmoff_t off, bool copy,
@@ -187,6 +282,7 @@ task_create_thread(struct task *t, struct threadref *ref)
     }
 
   task_lock (t);
+  th->pset = t->pset;
   LIST_INSERT_HEAD (&t->threads, th, list_entry);
   task_unlock (t);
 
@@ -211,6 +307,47 @@ threadref_consume_implicit(struct thread *th)
   threadref_consume(&ref);
 }
 
+/*
+  Total CPU times of a task: its live threads plus the ones already
+  destroyed.
+*/
+void
+task_times (struct task *t, uint64_t *utime, uint64_t *stime)
+{
+  struct thread *th;
+  uint64_t u, s;
+
+  task_lock (t);
+  *utime = t->dead_utime;
+  *stime = t->dead_stime;
+  LIST_FOREACH (th, &t->threads, list_entry)
+    {
+      thread_times (th, &u, &s);
+      *utime += u;
+      *stime += s;
+    }
+  task_unlock (t);
+}
+
+/*
+  Move a task and all its threads to a processor set.
+*/
+void
+task_setpset (struct task *t, struct procset *ps)
+{
+  struct thread *th;
+
+  task_lock (t);
+  t->pset = ps;
+  LIST_FOREACH (th, &t->threads, list_entry)
+    {
+      thread_lock (th);
+      _sched_setpset (th, ps);
+      thread_unlock (th);
+    }
+  task_unlock (t);
+}
+
 void
 _task_destroy_thread(struct thread *th)
 {
@@ -222,9 +359,12 @@ _task_destroy_thread(struct thread *th)
 
   task_lock (t);
   LIST_REMOVE (th, list_entry);
+  t->dead_utime += th->utime;
+  t->dead_stime += th->stime;
   TASK_PRINT("TASK STATUS IS %s\n", t->status == TASK_DESTROYING ? "DESTROYING" : "ACTIVE");
   if ((t->status == TASK_DESTROYING) && LIST_EMPTY(&t->threads))
     TAILQ_INSERT_TAIL (&cur_cpu ()->dead_tasks, t, task_list);
+  cpu_pending_set (cur_cpu (), CPU_PENDING_REAP);
   task_unlock (t);
 
   /*
@@ -277,6 +417,14 @@ task_bootstrap (struct taskref *taskref)
   port_alloc_kernel ((void *) t, KOT_TASK, &t->self);
   t->_ref_count = 0;
   t->status = TASK_ACTIVE;
+  t->status_page.kaddr = 0;
+  t->time_page.kaddr = 0;
+  memset (t->status_map, 0, sizeof (t->status_map));
+  t->dead_utime = 0;
+  t->dead_stime = 0;
+  LIST_INIT (&t->alarms);
+  t->nr_alarms = 0;
+  t->pset = procset_default ();
 
   /*
     Allocate Implicit reference to task.
@@ -330,8 +478,16 @@ void
 task_zeroref (struct task *task)
 {
   TASK_PRINT ("TASK ZERO REF");
+  clock_cancelalarms (task);
   vmmap_destroy (&task->vmmap);
   ipcspace_destroy(&task->ipcspace);
+  /*
+    The user mapping is gone with the vmmap, and the ports have been
+    unbound by the ipcspace destruction. The time page is shared by
+    all tasks, and never freed.
+  */
+  if (task->status_page.kaddr != 0)
+    msgbuf_kfree (&task->status_page);
   slab_free (task);
   slab_printstats();
 }
@@ -340,5 +496,5 @@ void
 task_init (void)
 {
 
-  slab_register (&tasks, "TASKS", sizeof (struct task), NULL, 0);
+  slab_register (&tasks, "TASKS", sizeof (struct task), NULL, 1);
 }
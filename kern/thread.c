@@ -5,6 +5,7 @@
 */
 
 #include <nux/slab.h>
+#include <machina/clock.h>
 #include <machina/error.h>
 #include "internal.h"
 
@@ -21,6 +22,8 @@ DEFINE_LOCK_MEASURE(thread_lock_msr);
 
 struct slab threads;
 
+static void thread_vtalrm_expired (void *opq);
+
 unsigned long *
 thread_refcnt(struct thread *th)
 {
@@ -40,6 +43,7 @@ thread_idle (void)
   memset (th, 0, sizeof (struct thread));
   th->uctxt = UCTXT_IDLE;
   th->status = SCHED_RUNNABLE;
+  th->depress_pri = MCN_PRI_LEVELS;
   return th;
 }
 
@@ -50,12 +54,17 @@ thread_new (struct task *task)
   struct thread *th = slab_alloc (&threads);
 
   th->uctxt = (uctxt_t *) (th + 1);
+  th->uframe = NULL;
   uctxt_init (th->uctxt, 0, 0, 0);
   timer_init (&th->timeout);
+  timer_init (&th->depress);
+  timer_init (&th->vtt_alarm);
+  th->vtt_alarm.opq = (void *) th;
+  th->vtt_alarm.handler = thread_vtalrm_expired;
   spinlock_init (&th->lock);
   port_alloc_kernel ((void *) th, KOT_THREAD, &th->self);
 
-  if (!vmmap_allocmsgbuf (vmmap, &th->msgbuf))
+  if (!vmmap_allocmsgbuf (vmmap, &th->msgbuf, true))
     {
       slab_free (th);
       return NULL;
@@ -70,6 +79,23 @@ thread_new (struct task *task)
 
   th->task = task;
   th->_ref_count = 0;
+  th->cpu = cpu_id ();
+  th->pri = MCN_PRI_USER;
+  th->runq = NULL;
+  th->waker = NULL;
+  th->rt_period = 0;
+  th->depress_pri = MCN_PRI_LEVELS;
+  th->rt_misses = 0;
+  th->rt_demotions = 0;
+  th->waitq = NULL;
+  th->waitq_queued = false;
+  th->utime = 0;
+  th->stime = 0;
+  th->vtt_offset = 0;
+  th->vtt_rttbase = 0;
+  th->vtt_almtime = 0;
+  th->vtt_almperiod = 0;
+  th->vtt_almport = PORTREF_NULL;
 
   _sched_add (th);
 
@@ -85,8 +111,12 @@ thread_zeroref (struct thread *th)
   struct vmmap *vmmap = &task->vmmap;
 
   /*
-    Zero reference remaining. We can free the structure.
+    Zero reference remaining. We can free the structure once no
+    timer handler can still look at it.
   */
+  timer_remove_sync (&th->timeout);
+  timer_remove_sync (&th->depress);
+  timer_remove_sync (&th->vtt_alarm);
   vmmap_freemsgbuf (vmmap, &th->msgbuf);
   vmmap_freetls (vmmap, th->tls);
 
@@ -131,22 +161,49 @@ thread_getport (struct thread *th)
   return ret;
 }
 
+/*
+  Take a thread off its wait queue, if it's waiting. Called with the
+  thread locked.
+
+  A waker might have dequeued the thread already. Clearing `waitq`
+  tells it that the thread is not waiting anymore.
+*/
+void
+thread_unwait (struct thread *th, bool intimer)
+{
+  struct waitq *wq = th->waitq;
+
+  if (wq == NULL)
+    return;
+
+  waitq_lock (wq);
+  if (th->waitq_queued)
+    {
+      TAILQ_REMOVE (&wq->queue, th, waitq_list);
+      th->waitq_queued = false;
+    }
+  waitq_unlock (wq);
+
+  if (!intimer)
+    timer_remove (&th->timeout);
+  th->waitq = NULL;
+}
+
 static void
 thread_abort (struct thread *th, bool intimer, bool setret)
 {
   thread_lock (th);
+  /* The wait might have ended, and another started, since expiry. */
+  if (intimer && !timer_claim (&th->timeout))
+    {
+      thread_unlock (th);
+      return;
+    }
   if (th->waitq != NULL)
     {
-      waitq_lock (th->waitq);
-      TAILQ_REMOVE (&th->waitq->queue, th, sched_list);
-      waitq_unlock (th->waitq);
-
-      if (!intimer)
-	timer_remove (&th->timeout);
-      th->waitq = NULL;
-
+      thread_unwait (th, intimer);
       if (setret)
-	uctxt_setret (th->uctxt, KERN_THREAD_TIMEDOUT);
+	uctxt_setret (thread_uctxt (th), KERN_THREAD_TIMEDOUT);
     }
   _sched_abort (th);
   thread_unlock (th);
@@ -177,58 +234,162 @@ thread_wait (struct waitq *wq, unsigned long timeout)
       t->valid = 1;
       t->opq = curth;
       t->handler = __waitq_timeout_handler;
+      t->slack = timer_slack (timeout * 1000 * 1000);
       timer_register (t, timeout * 1000 * 1000);
     }
   curth->waitq = wq;
   waitq_lock (wq);
-  TAILQ_INSERT_TAIL (&wq->queue, curth, sched_list);
+  TAILQ_INSERT_TAIL (&wq->queue, curth, waitq_list);
+  curth->waitq_queued = true;
   waitq_unlock (wq);
 
   _sched_suspend(curth);
   thread_unlock (curth);
 }
 
-bool
-thread_wakeone (struct waitq *wq)
+/*
+  Dequeue up to `max` threads from a wait queue, in a single lock
+  hold.
+*/
+static unsigned
+waitq_dequeue (struct waitq *wq, struct thread **ths, unsigned max)
 {
-  struct thread *th = NULL;
+  struct thread *th;
+  unsigned n = 0;
 
   waitq_lock (wq);
-  if (!TAILQ_EMPTY (&wq->queue))
+  while ((n < max) && ((th = TAILQ_FIRST (&wq->queue)) != NULL))
     {
-      th = TAILQ_FIRST (&wq->queue);
-      TAILQ_REMOVE (&wq->queue, th, sched_list);
+      TAILQ_REMOVE (&wq->queue, th, waitq_list);
+      th->waitq_queued = false;
+      ths[n++] = th;
     }
   waitq_unlock (wq);
 
-  if (th == NULL)
+  return n;
+}
+
+/*
+  Check that a thread we dequeued from `wq` is still waiting for
+  us. It might have been aborted or destroyed since, or even be
+  waiting again on the same queue. Called with the thread locked.
+*/
+static bool
+waitq_recheck (struct waitq *wq, struct thread *th)
+{
+  bool ours;
+
+  if (th->waitq != wq)
     return false;
 
-  thread_lock (th);
-  assert ((th->status == SCHED_STOPPED) || th->sched_op.op_suspend);
-  assert (th->waitq == wq);
-  timer_remove (&th->timeout);
-  th->waitq = NULL;
+  waitq_lock (wq);
+  ours = !th->waitq_queued;
+  waitq_unlock (wq);
 
-  _sched_resume(th);
-  thread_unlock (th);
-  return true;
+  return ours;
 }
 
-void
-thread_destroy (struct thread *th)
+/*
+  Wake up a thread dequeued from `wq`. IPIs are added to `kick`
+  if not NULL, or sent right away.
+*/
+static bool
+thread_wakeup (struct waitq *wq, struct thread *th, cpumask_t *kick)
 {
+  bool woken;
+
   thread_lock (th);
-  if (th->waitq != NULL)
+  woken = waitq_recheck (wq, th);
+  if (woken)
     {
-      waitq_lock (th->waitq);
-      TAILQ_REMOVE (&th->waitq->queue, th, sched_list);
-      waitq_lock (th->waitq);
-
+      assert ((th->status == SCHED_STOPPED) || th->sched_op.op_suspend);
       timer_remove (&th->timeout);
       th->waitq = NULL;
+      _sched_wakeup (th, kick);
     }
+  thread_unlock (th);
+
+  return woken;
+}
+
+bool
+thread_wakeone (struct waitq *wq)
+{
+  struct thread *th;
+
+  while (waitq_dequeue (wq, &th, 1) != 0)
+    if (thread_wakeup (wq, th, NULL))
+      return true;
+
+  return false;
+}
+
+/*
+  Wake up all threads in a wait queue, sending at most one IPI per
+  CPU. Returns the number of threads woken.
+
+  The queue can't be detached whole onto a local list: once dequeued,
+  a thread can be aborted and wait again before we lock it, reusing
+  its `waitq_list` entry while it would still be linked in our list.
+  Threads are instead copied out of the queue, WAITQ_BATCH per lock
+  hold, to a bounded array on the stack.
+*/
+unsigned
+thread_wakeall (struct waitq *wq)
+{
+  struct thread *ths[WAITQ_BATCH];
+  cpumask_t kick = 0;
+  unsigned i, n, woken = 0;
 
+  while ((n = waitq_dequeue (wq, ths, WAITQ_BATCH)) != 0)
+    for (i = 0; i < n; i++)
+      if (thread_wakeup (wq, ths[i], &kick))
+	woken++;
+
+  sched_kick (kick);
+  return woken;
+}
+
+/*
+  Move all the threads waiting on `from` to `to`, without waking
+  them up. Their timeouts are kept. Returns the number of threads
+  moved.
+*/
+unsigned
+thread_waitq_move (struct waitq *from, struct waitq *to)
+{
+  struct thread *ths[WAITQ_BATCH];
+  unsigned i, n, moved = 0;
+
+  assert (from != to);
+  while ((n = waitq_dequeue (from, ths, WAITQ_BATCH)) != 0)
+    for (i = 0; i < n; i++)
+      {
+	struct thread *th = ths[i];
+
+	thread_lock (th);
+	if (waitq_recheck (from, th))
+	  {
+	    th->waitq = to;
+	    waitq_lock (to);
+	    TAILQ_INSERT_TAIL (&to->queue, th, waitq_list);
+	    th->waitq_queued = true;
+	    waitq_unlock (to);
+	    moved++;
+	  }
+	thread_unlock (th);
+      }
+
+  return moved;
+}
+
+void
+thread_destroy (struct thread *th)
+{
+  struct portref almport;
+
+  thread_lock (th);
+  thread_unwait (th, false);
   _sched_destroy (th);
 
   /*
@@ -237,7 +398,115 @@ thread_destroy (struct thread *th)
   */
   port_unlink_kernel(&th->self);
 
+  /* The timer is removed when the thread is switched out. */
+  th->vtt_almtime = 0;
+  portref_move (&almport, &th->vtt_almport);
+
   thread_unlock (th);
+
+  if (!portref_isnull (&almport))
+    portref_consume (&almport);
+}
+
+void
+thread_setpriority (struct thread *th, unsigned pri)
+{
+  thread_lock (th);
+  _sched_setpri (th, pri);
+  thread_unlock (th);
+}
+
+mcn_return_t
+thread_setrealtime (struct thread *th, unsigned pri, uint64_t period,
+		    uint64_t computation)
+{
+  mcn_return_t rc;
+
+  thread_lock (th);
+  rc = _sched_setrt (th, pri, period, computation);
+  thread_unlock (th);
+  return rc;
+}
+
+/*
+  Read the CPU times of a thread. The values can lag behind by the
+  time the thread has been running on another CPU since it last
+  entered the kernel.
+*/
+void
+thread_times (struct thread *th, uint64_t *utime, uint64_t *stime)
+{
+  *utime = __atomic_load_n (&th->utime, __ATOMIC_RELAXED);
+  *stime = __atomic_load_n (&th->stime, __ATOMIC_RELAXED);
+}
+
+mcn_portid_t
+thread_self (void)
+{
+  mcn_portid_t ret;
+  struct ipcspace *ps;
+  struct portright pr;
+  struct thread *th = cur_thread ();
+
+  pr.type = RIGHT_SEND;
+  pr.portref = thread_getport (th);
+
+  ps = task_getipcspace (th->task);
+  if (ipcspace_insertright (ps, &pr, &ret))
+    {
+      portright_consume (&pr);
+      ret = MCN_PORTID_NULL;
+    }
+  task_putipcspace (th->task, ps);
+
+  return ret;
+}
+
+/*
+  Yield the CPU, optionally to the thread named `name` in the current
+  task's space. With MCN_SWITCH_DEPRESS, also depress the priority
+  of the current thread for `timeout` milliseconds, or until it runs
+  again if zero.
+*/
+mcn_return_t
+thread_switch (mcn_portid_t name, unsigned option, unsigned long timeout)
+{
+  mcn_return_t rc;
+  struct thread *curth = cur_thread ();
+  struct threadref target = THREADREF_NULL;
+  struct ipcspace *ps;
+  struct portref pr;
+
+  if (option & ~MCN_SWITCH_DEPRESS)
+    return KERN_INVALID_ARGUMENT;
+
+  if (name != MCN_PORTID_NULL)
+    {
+      ps = task_getipcspace (curth->task);
+      rc = ipcspace_resolve (ps, MCN_MSGTYPE_COPYSEND, name, &pr);
+      task_putipcspace (curth->task, ps);
+      if (rc)
+	return rc;
+
+      target = port_get_threadref (portref_unsafe_get (&pr));
+      portref_consume (&pr);
+      if (threadref_isnull (&target))
+	return KERN_INVALID_ARGUMENT;
+
+      if (threadref_unsafe_get (&target) == curth)
+	threadref_consume (&target);
+      else
+	sched_handoff_to (&target);
+    }
+
+  thread_lock (curth);
+  if (option & MCN_SWITCH_DEPRESS)
+    sched_depress (curth, timeout * 1000 * 1000);
+  curth->sched_op.op_yield = true;
+  cpu_pending_set (cur_cpu (), CPU_PENDING_SCHED);
+  thread_unlock (curth);
+
+  return KERN_SUCCESS;
 }
 
 void
@@ -256,24 +525,112 @@ thread_resume (struct thread *th)
   thread_unlock (th);
 }
 
-#if 0
+/*
+  Arm the virtual time alarm of a thread running on this CPU. Called
+  with the thread locked.
+*/
 void
-thread_vtalrm (int64_t diff)
+_thread_vtalrm_arm (struct thread *th)
 {
-  struct thread *th = cur_thread ();
   struct timer *t = &th->vtt_alarm;
+  uint64_t vtt;
 
-  thread_lock (th);
-  timer_remove (t);
-  t->time = timer_gettime () + diff;
-  t->opq = (void *) th;
-  t->handler = NULL;
+  if (th->vtt_almtime == 0)
+    return;
+
+  vtt = timer_gettime () - th->vtt_rttbase + th->vtt_offset;
   t->valid = 1;
-  debug ("Setting vtalm at %" PRIx64 "\n", t->time);
-  timer_register (t);
+  timer_register (t, th->vtt_almtime > vtt ? th->vtt_almtime - vtt : 0);
+}
+
+/*
+  The timer only runs while the thread does, on its CPU, so the
+  thread's CPU time has passed the alarm time unless the alarm has
+  been changed meanwhile.
+*/
+static void
+thread_vtalrm_expired (void *opq)
+{
+  struct thread *th = (struct thread *) opq;
+  struct portref port;
+  uint64_t vtt, time;
+
+  thread_lock (th);
+  if (!timer_claim (&th->vtt_alarm) || (th->vtt_almtime == 0)
+      || (cur_thread () != th))
+    {
+      thread_unlock (th);
+      return;
+    }
+
+  vtt = cur_vtt ();
+  time = th->vtt_almtime;
+  if (vtt < time)
+    {
+      _thread_vtalrm_arm (th);
+      thread_unlock (th);
+      return;
+    }
+
+  if (th->vtt_almperiod != 0)
+    {
+      port = portref_dup (&th->vtt_almport);
+      /* Skip the periods missed rather than sending a burst. */
+      th->vtt_almtime = time + th->vtt_almperiod;
+      if (th->vtt_almtime <= vtt)
+	th->vtt_almtime = vtt + th->vtt_almperiod;
+      _thread_vtalrm_arm (th);
+    }
+  else
+    {
+      portref_move (&port, &th->vtt_almport);
+      th->vtt_almtime = 0;
+    }
   thread_unlock (th);
+
+  nuxperf_inc (&pmachina_thread_vtalarms);
+  clock_sendalarm (&port, MCN_CLOCK_VTALARM_MSGID, time);
+}
+
+/*
+  Set the virtual time alarm of a thread to `nsecs` of CPU time from
+  now, repeating every `period` if not zero. Zero `nsecs` cancels the
+  alarm. Consumes the port reference.
+
+  The CPU time of a thread running on another CPU is only known as
+  of its last switch, and its alarm is only armed at its next switch.
+*/
+void
+thread_setvtalrm (struct thread *th, uint64_t nsecs, uint64_t period,
+		  struct portref *port)
+{
+  struct portref old;
+  uint64_t vtt;
+
+  thread_lock (th);
+  portref_move (&old, &th->vtt_almport);
+  timer_remove (&th->vtt_alarm);
+  if (nsecs == 0)
+    {
+      th->vtt_almtime = 0;
+      th->vtt_almperiod = 0;
+    }
+  else
+    {
+      vtt = th == cur_thread () ? cur_vtt () : th->vtt_offset;
+      th->vtt_almtime = vtt + nsecs;
+      th->vtt_almperiod = period;
+      portref_move (&th->vtt_almport, port);
+      if (th == cur_thread ())
+	_thread_vtalrm_arm (th);
+    }
+  thread_unlock (th);
+
+  if (!portref_isnull (&old))
+    portref_consume (&old);
+  if (!portref_isnull (port))
+    portref_consume (port);
 }
-#endif
 
 void
 thread_init (void)
@@ -6,98 +6,422 @@
 
 #include "internal.h"
 
-lock_t timers_lock = {0, };
-/**INDENT-OFF**/
-static LIST_HEAD (, timer) timers = LIST_HEAD_INITIALIZER (timers);
-/**INDENT-ON**/
+#define TIMER_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_LEVEL_SHIFT(_l) ((_l) * TIMER_WHEEL_BITS)
 
-void
-timer_run (void)
+/* `level` of a timer expired and waiting for its handler to run. */
+#define TIMER_EXPIRED TIMER_WHEEL_LEVELS
+/* `level` of a timer whose handler has been called, until claimed. */
+#define TIMER_RUNNING (TIMER_WHEEL_LEVELS + 1)
+
+static inline uint64_t
+timer_tick (uint64_t time)
+{
+  return time >> TIMER_TICK_SHIFT;
+}
+
+/* Latest time a timer can fire at: its position in the wheel. */
+static inline uint64_t
+timer_latest (struct timer *t)
+{
+  return t->time + t->slack;
+}
+
+static inline uint64_t
+rotr64 (uint64_t x, unsigned r)
 {
-  int updated;
-  uint64_t cnt = timer_gettime ();
-  struct timer *c, *t;
+  return r == 0 ? x : (x >> r) | (x << (64 - r));
+}
+
+static bool
+wheel_empty (struct timerwheel *w)
+{
+  for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++)
+    if (w->bitmap[l] != 0)
+      return false;
+  return true;
+}
+
+/*
+  Insert a timer in the slot of its latest expiry tick, at the lowest
+  level whose range from the wheel's clock covers it. Expired timers
+  go in the current slot.
+*/
+static void
+wheel_insert (struct timerwheel *w, struct timer *t)
+{
+  const uint64_t max = (1ULL << TIMER_LEVEL_SHIFT (TIMER_WHEEL_LEVELS)) - 1;
+  uint64_t tick = timer_tick (timer_latest (t));
+  uint64_t delta;
+  unsigned l, slot;
+
+  if (tick < w->clk)
+    tick = w->clk;
+  delta = tick - w->clk;
+  if (delta > max)
+    {
+      delta = max;
+      tick = w->clk + max;
+    }
 
-  spinlock (&timers_lock);
-  updated = 0;
-  LIST_FOREACH_SAFE (c, &timers, list, t)
-  {
-    if (c->time > cnt)
+  for (l = 0; l < TIMER_WHEEL_LEVELS - 1; l++)
+    if ((delta >> TIMER_LEVEL_SHIFT (l + 1)) == 0)
       break;
-    if (c->handler != NULL)
-      {
-	c->handler (c->opq);
-      }
-    c->valid = 0;
-    LIST_REMOVE (c, list);
-    updated = 1;
-  }
-  if (updated)
+
+  slot = (tick >> TIMER_LEVEL_SHIFT (l)) & TIMER_SLOT_MASK;
+  LIST_INSERT_HEAD (&w->slots[l][slot], t, list);
+  w->bitmap[l] |= 1ULL << slot;
+  t->wheel = w;
+  t->level = l;
+  t->slot = slot;
+}
+
+static void
+wheel_remove (struct timerwheel *w, struct timer *t)
+{
+  if (t->level == TIMER_RUNNING)
+    {
+      /* Not queued: just make the expiry unclaimable. */
+      t->wheel = NULL;
+      return;
+    }
+
+  LIST_REMOVE (t, list);
+  if ((t->level != TIMER_EXPIRED)
+      && LIST_EMPTY (&w->slots[t->level][t->slot]))
+    w->bitmap[t->level] &= ~(1ULL << t->slot);
+  t->wheel = NULL;
+}
+
+/*
+  Move the timers of a level 0 slot whose window has started to the
+  expired list, counting them in `ctr` if not NULL.
+*/
+static void
+wheel_expire_slot (struct timerwheel *w, unsigned slot, uint64_t now,
+		   nuxperf_t *ctr)
+{
+  struct timer *t, *n;
+
+  LIST_FOREACH_SAFE (t, &w->slots[0][slot], list, n)
     {
-      /* Update hw timer. */
-      c = LIST_FIRST (&timers);
-      if (c == NULL)
-	timer_clear ();
-      else
-	timer_alarm (c->time - cnt);
+      if (t->time > now)
+	continue;
+      wheel_remove (w, t);
+      LIST_INSERT_HEAD (&w->expired, t, list);
+      t->wheel = w;
+      t->level = TIMER_EXPIRED;
+      if (ctr != NULL)
+	nuxperf_inc (ctr);
     }
-  spinunlock (&timers_lock);
+}
+
+static void
+wheel_expire (struct timerwheel *w, uint64_t now)
+{
+  wheel_expire_slot (w, w->clk & TIMER_SLOT_MASK, now, NULL);
+}
+
+/*
+  Fire early the timers of the coming ticks whose window has
+  started, saving them an alarm of their own. Slack is bounded by
+  TIMER_SLACK_MAX_NSECS, about the range of level 0, so only level 0
+  is checked.
+*/
+static void
+wheel_coalesce (struct timerwheel *w, uint64_t now)
+{
+  uint64_t bits = w->bitmap[0] & ~(1ULL << (w->clk & TIMER_SLOT_MASK));
+  unsigned slot;
+
+  while (bits != 0)
+    {
+      slot = __builtin_ctzll (bits);
+      bits &= bits - 1;
+      wheel_expire_slot (w, slot, now, &pmachina_timer_coalesced);
+    }
+}
+
+/*
+  The clock has reached the start of a slot in the levels above:
+  redistribute their timers.
+*/
+static void
+wheel_cascade (struct timerwheel *w)
+{
+  struct timer *t;
+  unsigned l, slot;
+
+  for (l = 1; l < TIMER_WHEEL_LEVELS; l++)
+    {
+      if ((w->clk & ((1ULL << TIMER_LEVEL_SHIFT (l)) - 1)) != 0)
+	break;
+
+      slot = (w->clk >> TIMER_LEVEL_SHIFT (l)) & TIMER_SLOT_MASK;
+      while ((t = LIST_FIRST (&w->slots[l][slot])) != NULL)
+	{
+	  wheel_remove (w, t);
+	  wheel_insert (w, t);
+	  nuxperf_inc (&pmachina_timer_cascaded);
+	}
+    }
+}
+
+/*
+  Find the first tick after the clock at which a non-empty slot of
+  level `l` must be processed, or UINT64_MAX.
+*/
+static uint64_t
+wheel_next_level (struct timerwheel *w, unsigned l)
+{
+  uint64_t base = w->clk >> TIMER_LEVEL_SHIFT (l);
+  uint64_t bits = w->bitmap[l];
+
+  /* The current slot of level 0 only holds timers of this tick. */
+  if (l == 0)
+    bits &= ~(1ULL << (base & TIMER_SLOT_MASK));
+  if (bits == 0)
+    return UINT64_MAX;
+
+  /* Bit `k` is now slot `base + 1 + k`. */
+  bits = rotr64 (bits, (base + 1) & TIMER_SLOT_MASK);
+  return (base + 1 + __builtin_ctzll (bits)) << TIMER_LEVEL_SHIFT (l);
+}
+
+static uint64_t
+wheel_next (struct timerwheel *w)
+{
+  uint64_t next = UINT64_MAX;
+
+  for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++)
+    next = MIN (next, wheel_next_level (w, l));
+  return next;
+}
+
+static uint64_t
+wheel_slot_min (struct timerwheel *w, unsigned slot)
+{
+  uint64_t min = UINT64_MAX;
+  struct timer *t;
+
+  LIST_FOREACH (t, &w->slots[0][slot], list)
+    min = MIN (min, timer_latest (t));
+  return min;
+}
+
+/*
+  Earliest time the wheel needs attention: the earliest latest time
+  of the timers in level 0, or the start of the next cascade.
+*/
+static uint64_t
+wheel_deadline (struct timerwheel *w)
+{
+  uint64_t dl, next0, next = UINT64_MAX;
+
+  dl = wheel_slot_min (w, w->clk & TIMER_SLOT_MASK);
+
+  next0 = wheel_next_level (w, 0);
+  for (unsigned l = 1; l < TIMER_WHEEL_LEVELS; l++)
+    next = MIN (next, wheel_next_level (w, l));
+
+  if (next0 < next)
+    dl = MIN (dl, wheel_slot_min (w, next0 & TIMER_SLOT_MASK));
+  else if (next != UINT64_MAX)
+    dl = MIN (dl, next << TIMER_TICK_SHIFT);
+
+  return dl;
+}
+
+static void
+wheel_program (uint64_t deadline, uint64_t now)
+{
+  if (deadline == UINT64_MAX)
+    timer_clear ();
+  else
+    timer_alarm (deadline > now ? deadline - now : 0);
 }
 
 void
-timer_register (struct timer *t, uint64_t nsecs)
+timer_cpu_init (struct timerwheel *w)
 {
-  struct timer *c;
-  uint64_t curtime = timer_gettime ();
-  uint64_t time = curtime + nsecs;
+  spinlock_init (&w->lock);
+  w->clk = timer_tick (timer_gettime ());
+  w->alarm = UINT64_MAX;
+  for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++)
+    {
+      w->bitmap[l] = 0;
+      for (unsigned i = 0; i < TIMER_WHEEL_SLOTS; i++)
+	LIST_INIT (&w->slots[l][i]);
+    }
+  LIST_INIT (&w->expired);
+  w->running = NULL;
+}
 
-  if (!t->valid)
-    return;
+/*
+  Run the handlers of the expired timers of this CPU, and set the
+  alarm to the next deadline.
+*/
+void
+timer_run (void)
+{
+  struct timerwheel *w = &cur_cpu ()->timers;
+  uint64_t now = timer_gettime ();
+  uint64_t next, tick = timer_tick (now);
+  void (*handler) (void *opq);
+  struct timer *t;
+  void *opq;
 
-  t->time = time;
+  spinlock (&w->lock);
+  wheel_expire (w, now);
+  while ((next = wheel_next (w)) <= tick)
+    {
+      w->clk = next;
+      wheel_cascade (w);
+      wheel_expire (w, now);
+    }
+  /* Nothing is queued in the ticks skipped. */
+  if (w->clk < tick)
+    w->clk = tick;
+  wheel_coalesce (w, now);
 
-  spinlock (&timers_lock);
-  c = LIST_FIRST (&timers);
-  if (c == NULL)
+  /*
+    Handlers can take locks held while removing timers, and register
+    timers themselves: run them unlocked. The timer stays on the
+    wheel as running until claimed, removed or registered again, and
+    is not touched after the handler returns: it might have freed it.
+  */
+  while ((t = LIST_FIRST (&w->expired)) != NULL)
     {
-      LIST_INSERT_HEAD (&timers, t, list);
-      goto out;
+      LIST_REMOVE (t, list);
+      t->level = TIMER_RUNNING;
+      t->valid = 0;
+      t->ran = w;
+      w->running = t;
+      handler = t->handler;
+      opq = t->opq;
+      spinunlock (&w->lock);
+
+      nuxperf_inc (&pmachina_timer_expired);
+      if (handler != NULL)
+	handler (opq);
+
+      spinlock (&w->lock);
+      w->running = NULL;
     }
-  /* XXX: rollover */
-  while (t->time > c->time)
+
+  next = wheel_deadline (w);
+  w->alarm = next;
+  spinunlock (&w->lock);
+
+  wheel_program (next, timer_gettime ());
+}
+
+/*
+  Remove a timer from its wheel. Returns with the timer not queued.
+*/
+static void
+timer_dequeue (struct timer *t)
+{
+  struct timerwheel *w;
+
+  while ((w = __atomic_load_n (&t->wheel, __ATOMIC_RELAXED)) != NULL)
     {
-      if (LIST_NEXT (c, list) == NULL)
+      spinlock (&w->lock);
+      if (t->wheel == w)
 	{
-	  LIST_INSERT_AFTER (c, t, list);
-	  goto out;
+	  wheel_remove (w, t);
+	  spinunlock (&w->lock);
+	  return;
 	}
-      c = LIST_NEXT (c, list);
+      spinunlock (&w->lock);
     }
-  LIST_INSERT_AFTER (c, t, list);
-out:
-  /* Update hw timer. */
-  c = LIST_FIRST (&timers);
-  spinunlock (&timers_lock);
-  timer_alarm (c->time - curtime);
 }
 
 void
-timer_remove (struct timer *timer)
+timer_register (struct timer *t, uint64_t nsecs)
 {
-  struct timer *c;
+  struct timerwheel *w = &cur_cpu ()->timers;
+  uint64_t now = timer_gettime ();
+  bool program = false;
 
-  if (!timer->valid)
+  if (!t->valid)
     return;
 
-  spinlock (&timers_lock);
-  LIST_REMOVE (timer, list);
-  /* Update hw timer. */
-  c = LIST_FIRST (&timers);
-  if (c == NULL)
-    timer_clear ();
-  else
-    timer_alarm (c->time);
-  spinunlock (&timers_lock);
+  timer_dequeue (t);
+
+  spinlock (&w->lock);
+  /* Don't let an idle wheel's clock lag behind. */
+  if (wheel_empty (w))
+    w->clk = timer_tick (now);
+  t->time = now + nsecs;
+  wheel_insert (w, t);
+  if (timer_latest (t) < w->alarm)
+    {
+      w->alarm = timer_latest (t);
+      program = true;
+    }
+  spinunlock (&w->lock);
 
+  if (program)
+    timer_alarm (nsecs + t->slack);
+}
+
+/*
+  Remove a timer. Its handler might still be called if it has
+  already expired, but it won't be able to claim the expiry.
+*/
+void
+timer_remove (struct timer *timer)
+{
+  timer_dequeue (timer);
   timer->valid = 0;
 }
+
+/*
+  Claim the expiry of a timer whose handler is running. Fails if the
+  timer has been removed or registered again since it expired, or if
+  the expiry has already been claimed. Handlers call this under the
+  lock held by the callers of timer_remove and timer_register.
+*/
+bool
+timer_claim (struct timer *t)
+{
+  struct timerwheel *w = &cur_cpu ()->timers;
+  bool claimed;
+
+  spinlock (&w->lock);
+  claimed = (t->wheel == w) && (t->level == TIMER_RUNNING);
+  if (claimed)
+    t->wheel = NULL;
+  spinunlock (&w->lock);
+
+  return claimed;
+}
+
+/*
+  Remove a timer, and wait for its handler to return if it is
+  running on another CPU. Called before freeing the timer, without
+  holding any lock its handler takes.
+*/
+void
+timer_remove_sync (struct timer *t)
+{
+  struct timerwheel *w;
+  bool running;
+
+  timer_remove (t);
+
+  w = __atomic_load_n (&t->ran, __ATOMIC_RELAXED);
+  if ((w == NULL) || (w == &cur_cpu ()->timers))
+    return;
+
+  do
+    {
+      spinlock (&w->lock);
+      running = w->running == t;
+      spinunlock (&w->lock);
+      if (running)
+	cpu_relax ();
+    }
+  while (running);
+}
@@ -368,7 +368,9 @@ struct vmmap
 };
 
 struct msgbuf;
-bool vmmap_allocmsgbuf (struct vmmap *map, struct msgbuf *msgbuf);
+bool vmmap_allocmsgbuf (struct vmmap *map, struct msgbuf *msgbuf, bool uwr);
+bool vmmap_sharemsgbuf (struct vmmap *map, vaddr_t kaddr,
+			struct msgbuf *msgbuf);
 bool vmmap_alloctls (struct vmmap *map, uaddr_t * tls);
 void vmmap_freemsgbuf (struct vmmap *map, struct msgbuf *msgbuf);
 void vmmap_freetls (struct vmmap *map, uaddr_t uaddr);
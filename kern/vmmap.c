@@ -14,12 +14,23 @@
 #endif
 
 bool
-vmmap_allocmsgbuf (struct vmmap *map, struct msgbuf *msgbuf)
+vmmap_allocmsgbuf (struct vmmap *map, struct msgbuf *msgbuf, bool uwr)
 {
   bool ret;
 
   spinlock(&map->lock);
-  ret = msgbuf_alloc (&map->umap, &map->msgbuf_zone, msgbuf);
+  ret = msgbuf_alloc (&map->umap, &map->msgbuf_zone, msgbuf, uwr);
+  spinunlock(&map->lock);
+  return ret;
+}
+
+bool
+vmmap_sharemsgbuf (struct vmmap *map, vaddr_t kaddr, struct msgbuf *msgbuf)
+{
+  bool ret;
+
+  spinlock(&map->lock);
+  ret = msgbuf_share (&map->umap, &map->msgbuf_zone, kaddr, msgbuf);
   spinunlock(&map->lock);
   return ret;
 }
@@ -61,7 +72,7 @@ vmmap_alloctls (struct vmmap *map, uaddr_t * tls)
      For now, alloc a message buffer. :-(
    */
   struct msgbuf tlsmb;
-  assert (msgbuf_alloc (&map->umap, &map->msgbuf_zone, &tlsmb));
+  assert (msgbuf_alloc (&map->umap, &map->msgbuf_zone, &tlsmb, true));
   switch (tlsv)
     {
     case TLS_VARIANT_I:
@@ -8,12 +8,21 @@
 #define _MACHINA_MACHINA_H
 
 #include <machina/types.h>
+#include <machina/portstatus.h>
+#include <machina/timepage.h>
 
 mcn_msgioret_t mcn_msgsend (mcn_msgopt_t option, unsigned long timeout,
 			    mcn_portid_t notify);
 mcn_msgioret_t mcn_msgrecv (mcn_portid_t port, mcn_msgopt_t option,
 			    unsigned long timeout, mcn_portid_t notify);
+mcn_msgioret_t mcn_msgsend_short (mcn_portid_t dest, mcn_msgid_t msgid,
+				  unsigned long w0, unsigned long w1,
+				  unsigned long w2, unsigned long w3);
+volatile mcn_portstatus_t *mcn_port_status (mcn_portid_t port);
 mcn_portid_t mcn_reply_port (void);
 mcn_portid_t mcn_task_self (void);
+mcn_portid_t mcn_thread_self (void);
+mcn_portid_t mcn_host_self (void);
+uint64_t mcn_clock_monotonic (void);
 
 #endif
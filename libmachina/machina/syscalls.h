@@ -8,17 +8,28 @@
 #define _MACHINA_SYSCALLS_H_
 
 #include <machina/types.h>
+#include <machina/message.h>
 
 extern __thread void *__local_msgbuf;
 
 void *syscall_msgbuf (void);
+void *syscall_status_page (void);
+void *syscall_time_page (void);
+long syscall_port_status (mcn_portid_t port);
 
 mcn_return_t syscall_msgsend (mcn_msgopt_t option, unsigned long timeout,
 			      mcn_portid_t notify);
 mcn_return_t syscall_msgrecv (mcn_portid_t recv, mcn_msgopt_t option,
 			      unsigned long timeout, mcn_portid_t notify);
+mcn_return_t syscall_msgsend_short (mcn_portid_t dest, mcn_msgid_t msgid,
+				    unsigned long w0, unsigned long w1,
+				    unsigned long w2, unsigned long w3);
 mcn_return_t syscall_reply_port (void);
 
 mcn_portid_t syscall_task_self (void);
+mcn_portid_t syscall_thread_self (void);
+mcn_portid_t syscall_host_self (void);
+mcn_return_t syscall_thread_switch (mcn_portid_t thread, unsigned option,
+				    unsigned long timeout);
 
 #endif
@@ -4,12 +4,16 @@
   SPDX-License-Identifier:	BSD-2-Clause
 */
 
+#include <stddef.h>
 #include <machina/types.h>
 #include <machina/error.h>
 #include <machina/message.h>
+#include <machina/portstatus.h>
+#include <machina/timepage.h>
 #include <machina/syscalls.h>
 
 static mcn_portid_t task_self_ = MCN_PORTID_NULL;
+static const mcn_timepage_t *timepage_ = NULL;
 
 void __attribute__((constructor (0))) __machina_libinit (void)
 {
@@ -45,6 +49,42 @@ mcn_msgsend (mcn_msgopt_t option, unsigned long timeout, mcn_portid_t notify)
   return rc;
 }
 
+mcn_msgioret_t
+mcn_msgsend_short (mcn_portid_t dest, mcn_msgid_t msgid, unsigned long w0,
+		   unsigned long w1, unsigned long w2, unsigned long w3)
+{
+  mcn_msgioret_t rc;
+
+  do
+    {
+      rc = (mcn_msgioret_t) syscall_msgsend_short (dest, msgid,
+						   w0, w1, w2, w3);
+    }
+  while (rc == KERN_RETRY);
+
+  return rc;
+}
+
+/*
+  Return the status slot of port `port`, binding it if needed.
+*/
+volatile mcn_portstatus_t *
+mcn_port_status (mcn_portid_t port)
+{
+  long slot;
+  mcn_portstatus_t *page;
+
+  page = syscall_status_page ();
+  if (page == (void *) -1)
+    return NULL;
+
+  slot = syscall_port_status (port);
+  if (slot < 0)
+    return NULL;
+
+  return page + slot;
+}
+
 mcn_portid_t
 mcn_reply_port (void)
 {
@@ -56,3 +96,36 @@ mcn_task_self (void)
 {
   return task_self_;
 }
+
+mcn_portid_t
+mcn_thread_self (void)
+{
+  return syscall_thread_self ();
+}
+
+mcn_portid_t
+mcn_host_self (void)
+{
+  return syscall_host_self ();
+}
+
+/*
+  Return the kernel monotonic time in nanoseconds, read from the time
+  page without entering the kernel. Returns zero if the page can't
+  be mapped.
+*/
+uint64_t
+mcn_clock_monotonic (void)
+{
+  const mcn_timepage_t *tp = timepage_;
+
+  if (tp == NULL)
+    {
+      tp = syscall_time_page ();
+      if (tp == (void *) -1)
+	return 0;
+      timepage_ = tp;
+    }
+
+  return mcn_timepage_read (tp);
+}
@@ -25,6 +25,24 @@ syscall_msgbuf (void)
   return __local_msgbuf;
 }
 
+void *
+syscall_status_page (void)
+{
+  return (void *) syscall0 (__syscall_status_page);
+}
+
+void *
+syscall_time_page (void)
+{
+  return (void *) syscall0 (__syscall_time_page);
+}
+
+long
+syscall_port_status (mcn_portid_t port)
+{
+  return syscall1 (__syscall_port_status, port);
+}
+
 mcn_return_t
 syscall_msgsend (mcn_msgopt_t option, unsigned long timeout,
 		 mcn_portid_t notify)
@@ -39,12 +57,39 @@ syscall_msgrecv (mcn_portid_t port, mcn_msgopt_t option,
   return syscall4 (__syscall_msgrecv, port, option, timeout, notify);
 }
 
+mcn_return_t
+syscall_msgsend_short (mcn_portid_t dest, mcn_msgid_t msgid,
+		       unsigned long w0, unsigned long w1, unsigned long w2,
+		       unsigned long w3)
+{
+  return syscall6 (__syscall_msgsend_short, dest, msgid, w0, w1, w2, w3);
+}
+
 mcn_return_t
 syscall_reply_port (void)
 {
   return syscall0 (__syscall_reply_port);
 }
 
+mcn_portid_t
+syscall_thread_self (void)
+{
+  return syscall0 (__syscall_thread_self);
+}
+
+mcn_return_t
+syscall_thread_switch (mcn_portid_t thread, unsigned option,
+		       unsigned long timeout)
+{
+  return syscall3 (__syscall_thread_switch, thread, option, timeout);
+}
+
+mcn_portid_t
+syscall_host_self (void)
+{
+  return syscall0 (__syscall_host_self);
+}
+
 mcn_portid_t
 syscall_task_self (void)
 {
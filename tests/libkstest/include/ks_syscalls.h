@@ -31,3 +31,6 @@ struct _test_syscall_vm_map_in
 #define _test_syscall_vm_allocate -65L
 #define _test_syscall_vm_deallocate -66L
 #define _test_syscall_port_allocate -72L
+#define _test_syscall_waitq_move -73L
+#define _test_syscall_thread_pri -74L
+#define _test_syscall_host_priv -75L
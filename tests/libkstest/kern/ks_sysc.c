@@ -252,7 +252,65 @@ kstest_sysc (uctxt_t * u,
 	ret = KERN_SUCCESS;
 	break;
       }
+
+    case _test_syscall_waitq_move:
+      {
+	struct ipcspace *ps;
+	struct portref from_pr, to_pr;
+	struct port *from, *to;
+	unsigned moved, woken;
+
+	/*
+	  Move the receivers waiting on port `a2` to port `a3`, and wake
+	  them from there. They go back to waiting on `a2`.
+	*/
+	ps = task_getipcspace (cur_task ());
+	ret = ipcspace_resolve_receive (ps, a2, &from_pr);
+	if (ret == KERN_SUCCESS)
+	  {
+	    ret = ipcspace_resolve_receive (ps, a3, &to_pr);
+	    if (ret)
+	      portref_consume (&from_pr);
+	  }
+	task_putipcspace (cur_task (), ps);
+	if (ret)
+	  break;
+
+	from = portref_unsafe_get (&from_pr);
+	to = portref_unsafe_get (&to_pr);
+	if ((from == to) || (from->type != PORT_QUEUE)
+	    || (to->type != PORT_QUEUE))
+	  ret = KERN_INVALID_ARGUMENT;
+	else
+	  {
+	    moved = thread_waitq_move (&from->queue.recv_waitq,
+				       &to->queue.recv_waitq);
+	    woken = thread_wakeall (&to->queue.recv_waitq);
+	    printf ("SYSC: waitq moved %d woken %d\n", moved, woken);
+	    ret = moved == woken ? KERN_SUCCESS : KERN_FAILURE;
+	  }
+	portref_consume (&from_pr);
+	portref_consume (&to_pr);
+	break;
+      }
       
+    case _test_syscall_host_priv:
+      {
+	mcn_portid_t name;
+
+	/* Tasks have no other way to get the privileged host port yet. */
+	if (syscall_setport (host_getctrlport (host_system ()), &name))
+	  ret = MCN_PORTID_NULL;
+	else
+	  ret = name;
+	break;
+      }
+
+    case _test_syscall_thread_pri:
+      /* The current, possibly depressed, priority of the caller. */
+      ret = cur_thread ()->pri;
+      break;
+
     default:
       return false;
     }
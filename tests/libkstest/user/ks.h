@@ -6,6 +6,10 @@
 mcn_return_t syscall_port_allocate (mcn_portid_t task, mcn_portright_t right,
 				    mcn_portid_t * name);
 
+mcn_return_t syscall_waitq_move (mcn_portid_t from, mcn_portid_t to);
+long syscall_thread_pri (void);
+mcn_portid_t syscall_host_priv (void);
+
 mcn_return_t syscall_vm_region (mcn_portid_t task, mcn_vmaddr_t * addr,
 				unsigned long *size, mcn_vmprot_t * curprot,
 				mcn_vmprot_t * maxprot,
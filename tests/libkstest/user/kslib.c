@@ -18,6 +18,24 @@ syscall_port_allocate (mcn_portid_t task, mcn_portright_t right,
   return r;
 }
 
+mcn_return_t
+syscall_waitq_move (mcn_portid_t from, mcn_portid_t to)
+{
+  return syscall2 (_test_syscall_waitq_move, from, to);
+}
+
+mcn_portid_t
+syscall_host_priv (void)
+{
+  return syscall0 (_test_syscall_host_priv);
+}
+
+long
+syscall_thread_pri (void)
+{
+  return syscall0 (_test_syscall_thread_pri);
+}
+
 mcn_return_t
 syscall_vm_region (mcn_portid_t task, mcn_vmaddr_t * addr,
 		   unsigned long *size, mcn_vmprot_t * curprot,
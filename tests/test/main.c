@@ -5,10 +5,13 @@
 #include <machina/machina.h>
 #include <machina/mig.h>
 #include <machina/error.h>
+#include <machina/clock.h>
+#include <machina/notify.h>
 #include <string.h>
 
 #include <ks.h>
 #include <cs.h>
+#include <machina_user.h>
 #include <cs_server.h>
 
 #define printf(...) printf("\t\tTEST: " __VA_ARGS__);
@@ -126,6 +129,88 @@ main (void)
       ("************************* TEST END *******************************\n");
   }
 
+  {
+    volatile mcn_msgshort_t *msgs = (mcn_msgshort_t *) syscall_msgbuf ();
+
+    printf ("SHORT MSGIORET: %x\n", mcn_msgsend_short (2, 2001, 1, 2, 3, 4));
+    printf ("MSGIORET: %x\n",
+	    syscall_msgrecv (2, MCN_MSGOPT_NONE, 0, MCN_PORTID_NULL));
+    printf ("MSGID: %ld WORDS: %lx %lx %lx %lx\n",
+	    msgs->msgs_header.msgh_msgid, msgs->msgs_words[0],
+	    msgs->msgs_words[1], msgs->msgs_words[2], msgs->msgs_words[3]);
+  }
+
+  {
+    volatile mcn_portstatus_t *ps = mcn_port_status (2);
+
+    if (ps != NULL)
+      {
+	printf ("PORT STATUS: pending %d gen %d\n", ps->ps_pending,
+		ps->ps_gen);
+	(void) mcn_msgsend_short (2, 2002, 0, 0, 0, 0);
+	printf ("PORT STATUS: pending %d gen %d\n", ps->ps_pending,
+		ps->ps_gen);
+	(void) syscall_msgrecv (2, MCN_MSGOPT_NONE, 0, MCN_PORTID_NULL);
+      }
+  }
+
+  {
+    (void) mcn_msgsend_short (2, 2003, 0, 0, 0, 0);
+    printf ("SPIN MSGIORET: %x\n",
+	    syscall_msgrecv (2, MCN_MSGOPT_RECV_SPIN_USECS (100), 0,
+			     MCN_PORTID_NULL));
+  }
+
+  {
+    mcn_portid_t port = mcn_reply_port (), notify = mcn_reply_port ();
+    volatile struct mcn_msgheader *msgh =
+      (struct mcn_msgheader *) syscall_msgbuf ();
+    volatile mcn_msg_accepted_notification_t *not =
+      (mcn_msg_accepted_notification_t *) syscall_msgbuf ();
+    mcn_msgioret_t rc;
+    int n;
+
+    /* Fill the port: the first send that doesn't fit is parked. */
+    for (n = 0; n < 256; n++)
+      {
+	msgh->msgh_bits = MCN_MSGBITS (MCN_MSGTYPE_MAKESEND, 0);
+	msgh->msgh_size = sizeof (mcn_msgheader_t);
+	msgh->msgh_remote = port;
+	msgh->msgh_local = MCN_PORTID_NULL;
+	msgh->msgh_msgid = 2004;
+	rc = syscall_msgsend (MCN_MSGOPT_SEND_NOTIFY, 0, notify);
+	if (rc != MSGIO_SUCCESS)
+	  break;
+      }
+    printf ("PARKED MSGIORET: %x after %d (%s)\n", rc, n,
+	    rc == MSGIO_SEND_WILL_NOTIFY ? "ok" : "FAIL");
+
+    /* Receiving makes room for it, and the sender is notified. */
+    printf ("MSGIORET: %x\n",
+	    syscall_msgrecv (port, MCN_MSGOPT_NONE, 0, MCN_PORTID_NULL));
+    printf ("NOTIFY MSGIORET: %x\n",
+	    syscall_msgrecv (notify, MCN_MSGOPT_NONE, 0, MCN_PORTID_NULL));
+    printf ("NOTIFY MSGID: %ld port %ld (%s)\n",
+	    not->not_header.msgh_msgid, not->not_port,
+	    (not->not_header.msgh_msgid == MCN_NOTIFY_MSG_ACCEPTED)
+	    && (not->not_port == port) ? "ok" : "FAIL");
+
+    /* Parking is bounded too. */
+    for (n = 0; n < 256; n++)
+      {
+	msgh->msgh_bits = MCN_MSGBITS (MCN_MSGTYPE_MAKESEND, 0);
+	msgh->msgh_size = sizeof (mcn_msgheader_t);
+	msgh->msgh_remote = port;
+	msgh->msgh_local = MCN_PORTID_NULL;
+	msgh->msgh_msgid = 2005;
+	rc = syscall_msgsend (MCN_MSGOPT_SEND_NOTIFY, 0, notify);
+	if (rc != MSGIO_SEND_WILL_NOTIFY)
+	  break;
+      }
+    printf ("PARK LIMIT MSGIORET: %x after %d (%s)\n", rc, n,
+	    rc == MSGIO_SEND_NO_NOTIFY ? "ok" : "FAIL");
+  }
+
   volatile struct mcn_msgheader *msgh =
     (struct mcn_msgheader *) syscall_msgbuf ();
   msgh->msgh_bits = MCN_MSGBITS (MCN_MSGTYPE_MAKESEND, MCN_MSGTYPE_MAKESEND);
@@ -168,6 +253,11 @@ main (void)
   printf ("INC: %d\n", user_inc (3, &a));
   printf ("A %ld\n", a);
 
+  /* th1 is now waiting for messages on port 3. */
+  printf ("waitq move: %d\n", syscall_waitq_move (3, mcn_reply_port ()));
+  printf ("INC: %d\n", user_inc (3, &a));
+  printf ("A %ld\n", a);
+
   printf ("\n--\n\n");
 
   volatile int *ptr = (int *) 0x2000;
@@ -177,6 +267,153 @@ main (void)
   //  printf ("ptr is %lx\n", *ptr);
 
   printf ("task_self is %lx\n", syscall_task_self ());
+  printf ("thread_set_priority: %d\n",
+	  thread_set_priority (mcn_thread_self (), MCN_PRI_USER - 1));
+
+  {
+    long utime, stime;
+
+    printf ("thread_info: %d", thread_info (mcn_thread_self (), &utime, &stime));
+    printf (" user %ld system %ld\n", utime, stime);
+    printf ("task_info: %d", task_info (syscall_task_self (), &utime, &stime));
+    printf (" user %ld system %ld\n", utime, stime);
+  }
+
+  {
+    long pri = syscall_thread_pri ();
+
+    /* A depression ends when the thread runs again, switch or not. */
+    printf ("thread_switch depress: %d",
+	    syscall_thread_switch (MCN_PORTID_NULL, MCN_SWITCH_DEPRESS, 0));
+    printf (" (%s)\n", syscall_thread_pri () == pri ? "ok" : "FAIL");
+    printf ("thread_switch handoff self: %d",
+	    syscall_thread_switch (mcn_thread_self (), MCN_SWITCH_DEPRESS,
+				   1000));
+    printf (" (%s)\n", syscall_thread_pri () == pri ? "ok" : "FAIL");
+    /* Port 3 is not a thread port. */
+    printf ("thread_switch handoff port: %d\n",
+	    syscall_thread_switch (3, MCN_SWITCH_NONE, 0));
+  }
+
+  {
+    mcn_schedstats_t stats;
+
+    printf ("host_sched_stats: %d",
+	    host_sched_stats (mcn_host_self (), 0, &stats));
+    printf (" switches %ld migrations %ld\n",
+	    stats.ss_switches, stats.ss_migrations);
+  }
+
+  {
+    mcn_portid_t pset, newpset;
+    mcn_return_t rc;
+    long cpus;
+
+    printf ("host_procset_default: %d\n",
+	    host_procset_default (mcn_host_self (), &pset));
+    printf ("procset_info: %d", procset_info (pset, &cpus));
+    printf (" cpus %lx\n", cpus);
+
+    /* Repartitioning CPUs needs the privileged host port. */
+    rc = host_procset_create (mcn_host_self (), &newpset);
+    printf ("host_procset_create unprivileged: %d (%s)\n", rc,
+	    rc != KERN_SUCCESS ? "ok" : "FAIL");
+    printf ("host_procset_create: %d\n",
+	    host_procset_create (syscall_host_priv (), &newpset));
+    rc = procset_assign_cpu (mcn_host_self (), newpset, 0);
+    printf ("procset_assign_cpu unprivileged: %d (%s)\n", rc,
+	    rc != KERN_SUCCESS ? "ok" : "FAIL");
+  }
+
+  {
+    uint64_t t0, t1;
+
+    t0 = mcn_clock_monotonic ();
+    t1 = mcn_clock_monotonic ();
+    printf ("clock monotonic: %llu %llu (%s)\n", (unsigned long long) t0,
+	    (unsigned long long) t1, t1 >= t0 ? "ok" : "BACKWARDS");
+  }
+
+  {
+    mcn_portid_t priv = syscall_host_priv ();
+    mcn_return_t rc;
+    long misses, demotions;
+    uint64_t end;
+
+    rc = thread_set_realtime (mcn_host_self (), mcn_thread_self (), 0,
+			      100 * 1000 * 1000, 100 * 1000);
+    printf ("thread_set_realtime unprivileged: %d (%s)\n", rc,
+	    rc != KERN_SUCCESS ? "ok" : "FAIL");
+
+    /* 100% of a CPU is over the real-time admission limit. */
+    rc = thread_set_realtime (priv, mcn_thread_self (), 0, 1000 * 1000,
+			      1000 * 1000);
+    printf ("thread_set_realtime overcommit: %d (%s)\n", rc,
+	    rc == KERN_RESOURCE_SHORTAGE ? "ok" : "FAIL");
+
+    /* Overrun a 100us computation time: the watchdog demotes us. */
+    printf ("thread_set_realtime: %d\n",
+	    thread_set_realtime (priv, mcn_thread_self (), 0,
+				 100 * 1000 * 1000, 100 * 1000));
+    end = mcn_clock_monotonic () + 5 * 1000 * 1000;
+    while (mcn_clock_monotonic () < end)
+      ;
+    (void) syscall_thread_switch (MCN_PORTID_NULL, MCN_SWITCH_NONE, 0);
+    printf ("thread_rt_info: %d",
+	    thread_rt_info (mcn_thread_self (), &misses, &demotions));
+    printf (" misses %ld demotions %ld (%s)\n", misses, demotions,
+	    demotions == 1 ? "ok" : "FAIL");
+  }
+
+  {
+    mcn_portid_t clock, far_port, alarm_port = mcn_reply_port ();
+    volatile mcn_clock_alarm_msg_t *am =
+      (mcn_clock_alarm_msg_t *) syscall_msgbuf ();
+    long now;
+    int n;
+
+    printf ("host_get_clock: %d\n", host_get_clock (mcn_host_self (), &clock));
+    printf ("clock_get_time: %d", clock_get_time (clock, &now));
+    printf (" time %ld\n", now);
+    printf ("clock_alarm: %d\n",
+	    clock_alarm (clock, now + 1000 * 1000, alarm_port));
+    printf ("MSGIORET: %x\n",
+	    syscall_msgrecv (alarm_port, MCN_MSGOPT_NONE, 0, MCN_PORTID_NULL));
+    printf ("ALARM MSGID: %ld time %llu (%s)\n",
+	    am->alarm_header.msgh_msgid, (unsigned long long) am->alarm_time,
+	    mcn_clock_monotonic () >= am->alarm_time ? "ok" : "EARLY");
+
+    /* The page's time is never behind the clock's. */
+    printf ("clock_get_time: %d", clock_get_time (clock, &now));
+    printf (" (%s)\n", mcn_clock_monotonic () >= now ? "ok" : "BACKWARDS");
+
+    /* Alarms an hour away stay pending: the task runs out of them. */
+    far_port = mcn_reply_port ();
+    for (n = 0; n < 1000; n++)
+      if (clock_alarm (clock, now + 3600L * 1000 * 1000 * 1000, far_port))
+	break;
+    printf ("clock_alarm limit: %d (%s)\n", n, n < 1000 ? "ok" : "FAIL");
+  }
+
+  {
+    mcn_portid_t vtalarm_port = mcn_reply_port ();
+    volatile mcn_clock_alarm_msg_t *am =
+      (mcn_clock_alarm_msg_t *) syscall_msgbuf ();
+    uint64_t end;
+
+    printf ("thread_set_vtalarm: %d\n",
+	    thread_set_vtalarm (mcn_thread_self (), 1000 * 1000, 0,
+				vtalarm_port));
+    /* Spin to consume CPU time: the alarm doesn't run while blocked. */
+    end = mcn_clock_monotonic () + 2 * 1000 * 1000;
+    while (mcn_clock_monotonic () < end)
+      ;
+    printf ("MSGIORET: %x\n",
+	    syscall_msgrecv (vtalarm_port, MCN_MSGOPT_NONE, 0,
+			     MCN_PORTID_NULL));
+    printf ("VTALARM MSGID: %ld time %llu\n", am->alarm_header.msgh_msgid,
+	    (unsigned long long) am->alarm_time);
+  }
 
   mcn_vmaddr_t addr;
   printf ("vm allocate %lx\n",